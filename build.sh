@@ -6,4 +6,4 @@ fi
 cd build
 CXX=/usr/bin/g++ cmake ..
 make
-./simple-http-server --path=..
+./simple-http-server --path=../public
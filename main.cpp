@@ -1,34 +1,266 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <zlib.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cstdint>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <regex>
-#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <variant>
 #include <vector>
+#ifdef NHS_HAVE_BROTLI
+#include <brotli/encode.h>
+#if __has_include(<brotli/shared_dictionary.h>)
+#define NHS_HAVE_BROTLI_DICTIONARY
+#endif
+#endif
+#ifdef NHS_HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef NHS_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 namespace nek {
+  class file {
+    int fd_ = -1;
+
+  public:
+    file() = default;
+    explicit file(int fd) noexcept : fd_{fd} {
+    }
+
+    file(file const&) = delete;
+    file& operator=(file const&) = delete;
+
+    ~file() {
+      if (fd_ >= 0) {
+        ::close(fd_);
+      }
+    }
+
+    int fd() const noexcept {
+      return fd_;
+    }
+  };
+
+  // a region of a file which is transmitted by sendfile(2) and never copied into user space.
+  struct file_range {
+    std::shared_ptr<file const> source;
+    ::off_t offset = 0;
+    std::size_t length = 0;
+  };
+
+  // a part of an immutable string which is kept alive by shared ownership.
+  struct shared_slice {
+    std::shared_ptr<std::string const> owner;
+    std::string_view view;
+  };
+
+  // response body as a list of buffer references. only owned strings are copied when the chain is
+  // built; views, shared blobs and file ranges are sent as they are.
+  class buffer_chain {
+  public:
+    using chunk = std::variant<std::string, std::string_view, shared_slice, file_range>;
+
+  private:
+    std::vector<chunk> chunks_;
+    std::size_t size_ = 0;
+
+  public:
+    buffer_chain() = default;
+
+    std::vector<chunk> const& chunks() const noexcept {
+      return chunks_;
+    }
+
+    std::size_t size() const noexcept {
+      return size_;
+    }
+
+    bool empty() const noexcept {
+      return size_ == 0;
+    }
+
+    buffer_chain& append(std::string str) {
+      size_ += str.size();
+      chunks_.emplace_back(std::move(str));
+      return *this;
+    }
+
+    // the referenced memory must outlive the transmission.
+    buffer_chain& append_view(std::string_view view) {
+      size_ += view.size();
+      chunks_.emplace_back(view);
+      return *this;
+    }
+
+    buffer_chain& append_shared(std::shared_ptr<std::string const> blob) {
+      std::string_view const view{*blob};
+      return append_shared(std::move(blob), view);
+    }
+
+    // view must be a part of *owner.
+    buffer_chain& append_shared(std::shared_ptr<std::string const> owner, std::string_view view) {
+      size_ += view.size();
+      chunks_.emplace_back(shared_slice{std::move(owner), view});
+      return *this;
+    }
+
+    buffer_chain& append_file(file_range range) {
+      size_ += range.length;
+      chunks_.emplace_back(std::move(range));
+      return *this;
+    }
+
+    std::vector<chunk> take_chunks() noexcept {
+      size_ = 0;
+      return std::exchange(chunks_, {});
+    }
+
+    buffer_chain& prepend(std::string str) {
+      size_ += str.size();
+      chunks_.emplace(chunks_.begin(), std::move(str));
+      return *this;
+    }
+
+    // returns the memory of a chunk. file ranges have no memory and yield an empty view.
+    static std::string_view memory_of(chunk const& c) noexcept {
+      if (auto const* str = std::get_if<std::string>(&c)) {
+        return *str;
+      }
+      if (auto const* view = std::get_if<std::string_view>(&c)) {
+        return *view;
+      }
+      if (auto const* slice = std::get_if<shared_slice>(&c)) {
+        return slice->view;
+      }
+      return {};
+    }
+  };
+
+  // a template which is parsed once into static segments and holes. "{}" is a hole, "{{" and "}}"
+  // are literal braces. rendering references the static segments, so its cost depends on the
+  // number of holes and not on the size of the template. the segments share the ownership of the
+  // source, so rendered chains stay valid after the template is destroyed.
+  class text_template {
+    // a part is either a static segment or the index of a hole
+    using part = std::variant<std::string_view, std::size_t>;
+
+    std::shared_ptr<std::string const> source_;
+    std::vector<part> parts_;
+    std::size_t holes_ = 0;
+
+    template <typename T>
+    static std::string format_value(T const& value) {
+      if constexpr (std::is_same_v<T, bool>) {
+        return value ? "true" : "false";
+      } else if constexpr (std::is_arithmetic_v<T>) {
+        char buffer[64];
+        auto const result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+        return std::string(buffer, result.ptr);
+      } else {
+        return std::string(std::string_view{value});
+      }
+    }
+
+  public:
+    explicit text_template(std::string source)
+        : source_{std::make_shared<std::string const>(std::move(source))} {
+      std::string_view const src{*source_};
+      std::size_t begin = 0;
+      auto const flush = [&](std::size_t end) {
+        if (begin < end) {
+          parts_.emplace_back(src.substr(begin, end - begin));
+        }
+      };
+      for (std::size_t i = 0; i < src.size(); ++i) {
+        if (src[i] == '{' && i + 1 < src.size() && src[i + 1] == '{') {
+          flush(i + 1);
+          begin = ++i + 1;
+        } else if (src[i] == '}' && i + 1 < src.size() && src[i + 1] == '}') {
+          flush(i + 1);
+          begin = ++i + 1;
+        } else if (src[i] == '{') {
+          if (i + 1 >= src.size() || src[i + 1] != '}') {
+            throw std::invalid_argument{"text_template: unterminated hole"};
+          }
+          flush(i);
+          parts_.emplace_back(holes_++);
+          begin = ++i + 1;
+        }
+      }
+      flush(src.size());
+    }
+
+    std::size_t holes() const noexcept {
+      return holes_;
+    }
+
+    template <typename... Args>
+    buffer_chain render(Args const&... args) const {
+      if (sizeof...(Args) != holes_) {
+        throw std::invalid_argument{"text_template: the number of arguments does not match"};
+      }
+      std::array<std::string, sizeof...(Args)> values{format_value(args)...};
+      buffer_chain chain;
+      for (auto const& p : parts_) {
+        if (auto const* segment = std::get_if<std::string_view>(&p)) {
+          chain.append_shared(source_, *segment);
+        } else {
+          chain.append(std::move(values[std::get<std::size_t>(p)]));
+        }
+      }
+      return chain;
+    }
+  };
+
   class socket {
     int sock_ = 0;
-    int accepted_sock_ = 0;
     int port_ = 80;
 
   public:
@@ -36,27 +268,36 @@ namespace nek {
     explicit socket(int port) : port_{port} {
     }
 
+    socket(socket const&) = delete;
+    socket& operator=(socket const&) = delete;
+
     ~socket() {
       close();
     }
 
     void close() noexcept {
-      if (accepted_sock_ != 0) {
-        ::close(accepted_sock_);
-      }
       if (sock_ != 0) {
         ::close(sock_);
+        sock_ = 0;
       }
     }
 
+    int fd() const noexcept {
+      return sock_;
+    }
+
     int port() const noexcept {
       return port_;
     }
 
     void connect() {
-      if ((sock_ = ::socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      if ((sock_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         throw std::system_error{errno, std::generic_category(), "socket"};
       }
+      int val = 1;
+      ::setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+      // every event loop binds its own listener and the kernel spreads connections among them
+      ::setsockopt(sock_, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
       sockaddr_in addr;
       std::memset(&addr, 0, sizeof(addr));
       addr.sin_family = AF_INET;
@@ -65,49 +306,224 @@ namespace nek {
       if (::bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
         throw std::system_error{errno, std::generic_category(), "bind"};
       }
-      int val = 1;
-      ::ioctl(sock_, FIONBIO, &val);
     }
 
     void listen() {
       if (sock_ == 0) {
         throw std::logic_error{"socket is not created"};
       }
-      if (::listen(sock_, 5) != 0) {
+      if (::listen(sock_, SOMAXCONN) != 0) {
         throw std::system_error{errno, std::generic_category(), "listen"};
       }
     }
 
-    void accept() {
+    // returns a non-blocking accepted socket, or -1 when no connection is pending.
+    int accept() {
       if (sock_ == 0) {
         throw std::logic_error{"socket is not created"};
       }
-      while ((accepted_sock_ = ::accept(sock_, nullptr, nullptr)) <= 0) {
-        if (errno == EAGAIN) {
+      while (true) {
+        auto const accepted = ::accept4(sock_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (accepted >= 0) {
+          return accepted;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return -1;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
           continue;
         }
         throw std::system_error{errno, std::generic_category(), "accept"};
       }
     }
+  };
+
+  // pending output of a connection. responses are appended during an event loop iteration and
+  // written at once by flush(), so pipelined responses share syscalls. the queue keeps its
+  // position in the front chunk, so a short write resumes where it stopped.
+  class output_queue {
+    // written chunks before head_ are dropped together once the queue drains, so an empty queue
+    // keeps its capacity for the next response and an idle connection allocates nothing here.
+    std::vector<buffer_chain::chunk> chunks_;
+    std::size_t head_ = 0;
+    std::size_t offset_ = 0;  // bytes of the front chunk already written
+    std::size_t size_ = 0;
+    std::size_t memory_ = 0;  // bytes held in memory, file ranges excluded
+    std::size_t files_ = 0;
+
+    static std::size_t length_of(buffer_chain::chunk const& c) noexcept {
+      if (auto const* range = std::get_if<file_range>(&c)) {
+        return range->length;
+      }
+      return buffer_chain::memory_of(c).size();
+    }
+
+    bool drained() const noexcept {
+      return head_ == chunks_.size();
+    }
+
+    void pop_front() noexcept {
+      chunks_[head_++] = std::string_view{};
+      if (drained()) {
+        chunks_.clear();
+        head_ = 0;
+      }
+    }
+
+    void consume(std::size_t written) noexcept {
+      size_ -= written;
+      while (written > 0 || (!drained() && length_of(chunks_[head_]) == offset_)) {
+        auto const is_file = std::holds_alternative<file_range>(chunks_[head_]);
+        auto const remain = length_of(chunks_[head_]) - offset_;
+        if (written < remain) {
+          offset_ += written;
+          memory_ -= is_file ? 0 : written;
+          return;
+        }
+        written -= remain;
+        if (is_file) {
+          --files_;
+        } else {
+          memory_ -= remain;
+        }
+        pop_front();
+        offset_ = 0;
+      }
+    }
+
+    // returns the number of written bytes, or -1 when the socket would block.
+    ::ssize_t write_file(int fd) {
+      auto const& range = std::get<file_range>(chunks_[head_]);
+      ::off_t position = range.offset + static_cast<::off_t>(offset_);
+      while (true) {
+        auto const sent = ::sendfile(fd, range.source->fd(), &position, range.length - offset_);
+        if (sent >= 0) {
+          if (sent == 0) {
+            throw std::runtime_error{"sendfile: file is shorter than the range"};
+          }
+          return sent;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return -1;
+        }
+        if (errno != EINTR) {
+          throw std::system_error{errno, std::generic_category(), "sendfile"};
+        }
+      }
+    }
 
-    auto recv(char* buffer, std::size_t size) {
-      if (accepted_sock_ == 0) {
-        throw std::logic_error{"socket is not accepted"};
+    // gathers memory chunks up to the next file range into one sendmsg(2).
+    ::ssize_t write_memory(int fd) {
+      ::iovec iov[IOV_MAX];
+      int count = 0;
+      auto it = chunks_.begin() + static_cast<std::ptrdiff_t>(head_);
+      for (auto skip = offset_; it != chunks_.end() && count < IOV_MAX; ++it, skip = 0) {
+        if (std::holds_alternative<file_range>(*it)) {
+          break;
+        }
+        auto const memory = buffer_chain::memory_of(*it).substr(skip);
+        if (memory.empty()) {
+          continue;
+        }
+        iov[count].iov_base = const_cast<char*>(memory.data());
+        iov[count].iov_len = memory.size();
+        ++count;
       }
-      auto const recv_size = ::recv(accepted_sock_, buffer, size, 0);
-      if (recv_size < 0) {
-        if (errno == EAGAIN) {
-          return recv_size;
+      if (count == 0) {
+        return 0;
+      }
+      ::msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      auto const more = it != chunks_.end() ? MSG_MORE : 0;
+      while (true) {
+        auto const sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL | more);
+        if (sent >= 0) {
+          return sent;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return -1;
         }
-        throw std::system_error{errno, std::generic_category(), "recv"};
+        if (errno != EINTR) {
+          throw std::system_error{errno, std::generic_category(), "sendmsg"};
+        }
+      }
+    }
+
+  public:
+    bool empty() const noexcept {
+      return size_ == 0;
+    }
+
+    std::size_t size() const noexcept {
+      return size_;
+    }
+
+    std::size_t memory() const noexcept {
+      return memory_;
+    }
+
+    // bytes of the chunk slots, used or not.
+    std::size_t capacity() const noexcept {
+      return chunks_.capacity() * sizeof(buffer_chain::chunk);
+    }
+
+    // gives the chunk slots back to the heap when the queue is drained.
+    void trim() noexcept {
+      if (drained()) {
+        std::vector<buffer_chain::chunk>{}.swap(chunks_);
+        head_ = 0;
+      }
+    }
+
+    void push(buffer_chain::chunk c) {
+      auto const length = length_of(c);
+      if (length == 0) {
+        return;
+      }
+      if (head_ > 0 && head_ * 2 >= chunks_.size()) {
+        chunks_.erase(chunks_.begin(), chunks_.begin() + static_cast<std::ptrdiff_t>(head_));
+        head_ = 0;
+      }
+      size_ += length;
+      if (std::holds_alternative<file_range>(c)) {
+        ++files_;
+      } else {
+        memory_ += length;
       }
-      return recv_size;
+      chunks_.push_back(std::move(c));
     }
 
-    void send(std::string_view buf) {
-      if (::send(accepted_sock_, buf.data(), buf.size(), 0) < 0) {
-        throw std::system_error{errno, std::generic_category()};
+    void push(buffer_chain chain) {
+      for (auto& c : chain.take_chunks()) {
+        push(std::move(c));
+      }
+    }
+
+    // writes as much as the socket accepts. returns true when the queue is drained and false
+    // when the socket would block. while memory and file chunks are mixed, the socket is corked
+    // so that sendfile(2) does not push out partial frames between them.
+    bool flush(int fd) {
+      auto const cork = files_ > 0 && chunks_.size() - head_ > 1;
+      auto const set_cork = [fd](int val) {
+        ::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+      };
+      if (cork) {
+        set_cork(1);
+      }
+      while (!drained()) {
+        auto const written = std::holds_alternative<file_range>(chunks_[head_])
+                                 ? write_file(fd)
+                                 : write_memory(fd);
+        if (written < 0) {
+          break;
+        }
+        consume(static_cast<std::size_t>(written));
+      }
+      if (cork) {
+        set_cork(0);
       }
+      return drained();
     }
   };
 
@@ -127,21 +543,99 @@ namespace nek {
     invalid,
   };
 
+  // compares secrets in a time which depends on their lengths only, not on where they differ.
+  inline bool constant_time_equals(std::string_view lhs, std::string_view rhs) noexcept {
+    if (lhs.size() != rhs.size()) {
+      return false;
+    }
+    unsigned char difference = 0;
+    for (std::size_t i = 0; i < lhs.size(); ++i) {
+      difference |= static_cast<unsigned char>(lhs[i] ^ rhs[i]);
+    }
+    return difference == 0;
+  }
+
+  inline bool iequals(std::string_view lhs, std::string_view rhs) noexcept {
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char l, char r) {
+      return std::tolower(static_cast<unsigned char>(l)) ==
+             std::tolower(static_cast<unsigned char>(r));
+    });
+  }
+
+  inline std::string_view trim(std::string_view str) noexcept {
+    auto const first = str.find_first_not_of(" \t");
+    if (first == std::string_view::npos) {
+      return {};
+    }
+    return str.substr(first, str.find_last_not_of(" \t") - first + 1);
+  }
+
+  // returns the trimmed value of a header in pre-serialized lines terminated by CRLF.
+  inline std::string_view block_header(std::string_view block, std::string_view header) noexcept {
+    while (!block.empty()) {
+      auto const end = block.find("\r\n");
+      auto const line = block.substr(0, end);
+      block.remove_prefix(end == std::string_view::npos ? block.size() : end + 2);
+      auto const colon = line.find(':');
+      if (colon != std::string_view::npos && iequals(line.substr(0, colon), header)) {
+        return trim(line.substr(colon + 1));
+      }
+    }
+    return {};
+  }
+
+  // returns the quality value which an Accept-Encoding header gives to a content coding, taking
+  // "*" into account. 0 means that the coding is not acceptable.
+  inline double accept_quality(std::string_view accept, std::string_view coding) {
+    double wildcard = 0;
+    while (!accept.empty()) {
+      auto const comma = accept.find(',');
+      auto const item = accept.substr(0, comma);
+      accept.remove_prefix(comma == std::string_view::npos ? accept.size() : comma + 1);
+      auto const semicolon = item.find(';');
+      auto const token = trim(item.substr(0, semicolon));
+      double quality = 1;
+      if (semicolon != std::string_view::npos) {
+        auto const param = trim(item.substr(semicolon + 1));
+        if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+          std::from_chars(param.data() + 2, param.data() + param.size(), quality);
+        }
+      }
+      if (iequals(token, coding)) {
+        return quality;
+      }
+      if (token == "*") {
+        wildcard = quality;
+      }
+    }
+    return wildcard;
+  }
+
+  // the strings and headers of a request are allocated from the memory resource it is constructed
+  // with, which the event loop makes a per-connection arena released after each response. a copy
+  // allocates from the default resource, so it may outlive the arena.
   class request {
     friend class server;
-    std::unordered_map<std::string, std::string> headers_;
-    std::string method_;
-    std::string original_url_;
-    std::string path_;
-    std::string protocol_;
-    std::string hostname_;
-    std::string body_;
-    std::string http_version_;
+    friend class event_loop;
+    std::pmr::unordered_map<std::pmr::string, std::pmr::string> headers_;
+    std::pmr::string method_;
+    std::pmr::string original_url_;
+    std::pmr::string path_;
+    std::pmr::string protocol_;
+    std::pmr::string hostname_;
+    std::pmr::string body_;
+    std::pmr::string http_version_;
     parse_state state_ = parse_state::method;
+    std::size_t body_remaining_ = 0;  // bytes of the body still to be read
+    std::pair<std::pmr::string, std::pmr::string> header_buffer_;
+    bool close_ = false;
 
-    void parse_and_build(char const* buffer, ::ssize_t recv_size) {
-      std::pair<std::string, std::string> header_buffer;
-      for (auto i = 0; i < recv_size; ++i) {
+    // returns the number of consumed bytes. parsing stops at the end of a request, so the rest of
+    // the buffer belongs to the next pipelined request.
+    std::size_t parse_and_build(char const* buffer, std::size_t recv_size) {
+      auto& header_buffer = header_buffer_;
+      std::size_t i = 0;
+      for (; i < recv_size && state_ != parse_state::done && state_ != parse_state::invalid; ++i) {
         auto const it = buffer[i];
 
         switch (state_) {
@@ -205,18 +699,28 @@ namespace nek {
               break;
             }
             if (it == '\r') {
-              headers_.insert(header_buffer);
+              headers_.emplace(std::move(header_buffer));
               header_buffer.first.clear();
               header_buffer.second.clear();
               state_ = parse_state::cr;
               break;
             }
-            header_buffer.second.push_back(it);
+            // the rest of the value in the buffer at once, so that a long one is allocated once
+            auto const* const cr =
+                static_cast<char const*>(std::memchr(buffer + i, '\r', recv_size - i));
+            auto const length = (cr != nullptr ? cr : buffer + recv_size) - (buffer + i);
+            header_buffer.second.append(buffer + i, length);
+            i += length - 1;
             break;
           }
           case parse_state::body: {
-            body_.push_back(it);
-            // TODO: if body size is equal to content-length, state
+            auto const length = std::min(body_remaining_, recv_size - i);
+            body_.append(buffer + i, length);
+            body_remaining_ -= length;
+            i += length - 1;
+            if (body_remaining_ == 0) {
+              state_ = parse_state::done;
+            }
             break;
           }
           case parse_state::cr: {
@@ -239,8 +743,21 @@ namespace nek {
           case parse_state::crlfcr: {
             if (it == '\n') {
               state_ = parse_state::done;
-              // TODO: if content-length exists, state transits body. otherwise, state transits
-              // done.
+              auto const length = header("content-length");
+              if (length.empty()) {
+                break;
+              }
+              auto const [end, ec] =
+                  std::from_chars(length.data(), length.data() + length.size(), body_remaining_);
+              if (ec != std::errc{} || end != length.data() + length.size()) {
+                state_ = parse_state::invalid;
+                break;
+              }
+              if (body_remaining_ > 0) {
+                // parsing stops before the body, so that its length is checked before it is read
+                state_ = parse_state::body;
+                return i + 1;
+              }
               break;
             }
             state_ = parse_state::invalid;
@@ -254,198 +771,4346 @@ namespace nek {
             break;
         }
       }
+      return i;
     }
 
   public:
     request() = default;
 
-    std::unordered_map<std::string, std::string> const& headers() const noexcept {
+    // the body is allocated from the arena too unless it has a resource of its own.
+    explicit request(std::pmr::memory_resource* arena, std::pmr::memory_resource* body = nullptr)
+        : headers_{arena},
+          method_{arena},
+          original_url_{arena},
+          path_{arena},
+          protocol_{arena},
+          hostname_{arena},
+          body_{body != nullptr ? body : arena},
+          http_version_{arena},
+          header_buffer_{std::pmr::string{arena}, std::pmr::string{arena}} {
+    }
+
+    // scratch memory for the handler, released with the request after the handler returns. a body
+    // sent as a view is written later, so it must not be allocated here.
+    std::pmr::memory_resource* arena() const noexcept {
+      return headers_.get_allocator().resource();
+    }
+
+    // keyed by the lowercase names. the strings, like the views returned by the accessors below,
+    // live in the arena of the request.
+    std::pmr::unordered_map<std::pmr::string, std::pmr::string> const& headers() const noexcept {
       return headers_;
     }
 
-    std::string const& body() const noexcept {
+    std::string_view body() const noexcept {
       return body_;
     }
 
-    std::string const& hostname() const noexcept {
+    std::string_view hostname() const noexcept {
       return hostname_;
     }
 
-    std::string const& method() const noexcept {
+    std::string_view method() const noexcept {
       return method_;
     }
 
-    std::string const& original_url() const noexcept {
+    std::string_view original_url() const noexcept {
       return original_url_;
     }
 
-    std::string const& path() const noexcept {
+    std::string_view path() const noexcept {
       return path_;
     }
 
-    std::string const& protocol() const noexcept {
+    std::string_view protocol() const noexcept {
       return protocol_;
     }
 
-    std::string const& http_version() const noexcept {
+    std::string_view http_version() const noexcept {
       return http_version_;
     }
+
+    // returns the value of a header, or an empty view when the request does not have it.
+    std::string_view header(std::string_view name) const {
+      std::pmr::string lower_name{name, arena()};
+      std::transform(lower_name.begin(), lower_name.end(), lower_name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      auto const it = headers_.find(lower_name);
+      return it != headers_.end() ? std::string_view{it->second} : std::string_view{};
+    }
+
+    bool keep_alive() const {
+      if (close_) {
+        return false;
+      }
+      auto const value = header("connection");
+      if (http_version_ == "1.0") {
+        return iequals(value, "keep-alive");
+      }
+      return !iequals(value, "close");
+    }
   };
 
-  class response {
-    request const* request_ = nullptr;
-    socket* sock_ = nullptr;
-    std::unordered_map<std::string, std::string> headers_;
-    int status_ = 200;
-    std::string status_message_ = "";
+  constexpr std::size_t http_date_length = 29;  // "Sun, 06 Nov 1994 08:49:37 GMT"
 
-    static std::unordered_map<int, std::string const> default_status_messages;
+  // writes an IMF-fixdate of RFC 7231 and returns false if it does not fit.
+  inline bool format_http_date(std::time_t time, char (&out)[http_date_length + 1]) noexcept {
+    std::tm tm{};
+    ::gmtime_r(&time, &tm);
+    return std::strftime(out, sizeof(out), "%a, %d %b %Y %H:%M:%S GMT", &tm) == http_date_length;
+  }
 
-  public:
-    response(request const& request, socket& sock) : request_{&request}, sock_{&sock} {
+  inline bool parse_http_date(std::string_view value, std::time_t& out) noexcept {
+    char date[http_date_length + 1];
+    if (value.size() != http_date_length) {
+      return false;
+    }
+    value.copy(date, value.size());
+    date[http_date_length] = '\0';
+    std::tm tm{};
+    auto const* end = ::strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') {
+      return false;
     }
+    out = ::timegm(&tm);
+    return true;
+  }
 
-    std::unordered_map<std::string, std::string>& headers() noexcept {
-      return headers_;
+  // a 64 bit hash for validators. xxh3 when available; the fallback is a multiply-xorshift over
+  // 8 byte words which is fast but not meant to resist crafted collisions.
+  inline std::uint64_t hash64(std::string_view data, std::uint64_t seed = 0) noexcept {
+#ifdef NHS_HAVE_XXHASH
+    return ::XXH3_64bits_withSeed(data.data(), data.size(), seed);
+#else
+    constexpr std::uint64_t m = 0x9e3779b97f4a7c15ull;
+    auto h = seed ^ (data.size() * m);
+    auto const mix = [&h](std::uint64_t word) {
+      h ^= word * m;
+      h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ull;
+    };
+    std::size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, data.data() + i, 8);
+      mix(word);
+    }
+    if (i < data.size()) {
+      std::uint64_t word = 0;
+      std::memcpy(&word, data.data() + i, data.size() - i);
+      mix(word);
     }
+    h ^= h >> 32;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 29);
+#endif
+  }
 
-    void set_header(std::string const& header, std::string const& value) {
-      std::string lower_header;
-      lower_header.reserve(header.size());
-      std::transform(header.begin(), header.end(), lower_header.begin(),
-                     [](char c) { return std::tolower(c); });
-      headers_.emplace(lower_header, value);
+  // compares an If-None-Match list with an entity tag by the weak comparison of RFC 9110.
+  inline bool etag_matches(std::string_view list, std::string_view etag) noexcept {
+    auto const opaque = [](std::string_view tag) {
+      return tag.substr(0, 2) == "W/" ? tag.substr(2) : tag;
+    };
+    if (etag.empty()) {
+      return false;
+    }
+    while (!list.empty()) {
+      auto const comma = list.find(',');
+      auto const item = trim(list.substr(0, comma));
+      list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+      if (item == "*" || opaque(item) == opaque(etag)) {
+        return true;
+      }
     }
+    return false;
+  }
 
-    std::string const& get_header(std::string const& header) const {
-      std::string lower_header;
-      lower_header.reserve(header.size());
-      std::transform(header.begin(), header.end(), lower_header.begin(),
-                     [](char c) { return std::tolower(c); });
-      return headers_.at(lower_header);
+  // evaluates If-None-Match, or If-Modified-Since without it, for a GET or HEAD request.
+  inline bool not_modified(request const& req,
+                           std::string_view etag,
+                           std::string_view last_modified) {
+    if (req.method() != "GET" && req.method() != "HEAD") {
+      return false;
     }
+    if (auto const list = req.header("if-none-match"); !list.empty()) {
+      return etag_matches(list, etag);
+    }
+    std::time_t since{};
+    std::time_t modified{};
+    return parse_http_date(req.header("if-modified-since"), since) &&
+           parse_http_date(last_modified, modified) && modified <= since;
+  }
 
-    response& status(int status) {
-      status_ = status;
-      return *this;
+  // server-wide default headers, serialized once per thread. the Date value has a fixed length and
+  // is rewritten in place at most once per second by the event loop timer, so a response splices
+  // the whole block into its header with a single copy.
+  class header_preamble {
+    std::string block_;
+    std::size_t date_offset_ = 0;
+    std::time_t date_time_ = -1;
+
+  public:
+    static header_preamble& local() noexcept {
+      thread_local header_preamble preamble;
+      return preamble;
     }
 
-    response& status_message(std::string_view message) {
-      status_message_ = message;
-      return *this;
+    void reset(std::vector<std::pair<std::string, std::string>> const& headers) {
+      block_.clear();
+      for (auto const& [header, value] : headers) {
+        block_.append(header).append(": ").append(value).append("\r\n");
+      }
+      block_.append("Date: ");
+      date_offset_ = block_.size();
+      block_.append(http_date_length, ' ').append("\r\n");
+      date_time_ = -1;
+      refresh(std::time(nullptr));
     }
 
-    void send(std::string_view body) {
-      auto const message =
-          !status_message_.empty() ? status_message_ : default_status_messages[status_];
-      std::ostringstream oss;
-      oss << request_->protocol() << "/" << request_->http_version() << " " << status_ << " "
-          << message << "\r\n";
-      for (auto const& [header, value] : headers_) {
-        oss << header << ": " << value << "\r\n";
+    void refresh(std::time_t now) noexcept {
+      if (now == date_time_ || block_.empty()) {
+        return;
+      }
+      char date[http_date_length + 1];
+      if (format_http_date(now, date)) {
+        block_.replace(date_offset_, http_date_length, date, http_date_length);
+        date_time_ = now;
+      }
+    }
+
+    std::string_view block() const noexcept {
+      return block_;
+    }
+  };
+
+  inline std::array<std::uint8_t, 32> sha256(std::string_view data) {
+    static constexpr std::uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2};
+    std::uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto const rotr = [](std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    std::string message{data};
+    message.push_back('\x80');
+    while (message.size() % 64 != 56) {
+      message.push_back('\0');
+    }
+    auto const bits = static_cast<std::uint64_t>(data.size()) * 8;
+    for (auto shift = 56; shift >= 0; shift -= 8) {
+      message.push_back(static_cast<char>((bits >> shift) & 0xff));
+    }
+    for (std::size_t block = 0; block < message.size(); block += 64) {
+      std::uint32_t w[64];
+      for (auto i = 0; i < 16; ++i) {
+        auto const* p = reinterpret_cast<unsigned char const*>(message.data() + block + i * 4);
+        w[i] = std::uint32_t{p[0]} << 24 | std::uint32_t{p[1]} << 16 | std::uint32_t{p[2]} << 8 |
+               p[3];
+      }
+      for (auto i = 16; i < 64; ++i) {
+        auto const s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        auto const s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+      for (auto i = 0; i < 64; ++i) {
+        auto const t1 =
+            hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        auto const t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+      }
+      std::uint32_t const state[8] = {a, b, c, d, e, f, g, hh};
+      for (auto i = 0; i < 8; ++i) {
+        h[i] += state[i];
+      }
+    }
+    std::array<std::uint8_t, 32> digest;
+    for (auto i = 0; i < 32; ++i) {
+      digest[i] = static_cast<std::uint8_t>(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+    return digest;
+  }
+
+  inline std::string base64(std::string_view data) {
+    static constexpr char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    for (std::size_t i = 0; i < data.size(); i += 3) {
+      auto const remaining = data.size() - i;
+      std::uint32_t value = static_cast<unsigned char>(data[i]) << 16;
+      if (remaining > 1) {
+        value |= static_cast<unsigned char>(data[i + 1]) << 8;
       }
-      if (!body.empty()) {
-        oss << "Content-Length: " << body.size() << "\r\n";
-        // TODO: deduce content type from body
-        oss << "Content-Type: text/html\r\n";
+      if (remaining > 2) {
+        value |= static_cast<unsigned char>(data[i + 2]);
       }
-      oss << "Connection: Keep-Alive\r\n";
-      oss << "\r\n";
-      if (!body.empty()) {
-        oss << body;
+      out.push_back(alphabet[(value >> 18) & 0x3f]);
+      out.push_back(alphabet[(value >> 12) & 0x3f]);
+      out.push_back(remaining > 1 ? alphabet[(value >> 6) & 0x3f] : '=');
+      out.push_back(remaining > 2 ? alphabet[value & 0x3f] : '=');
+    }
+    return out;
+  }
+
+  // matches a path against a pattern where '*' matches any sequence of characters.
+  inline bool glob_match(std::string_view pattern, std::string_view text) noexcept {
+    std::size_t p = 0, t = 0;
+    auto star = std::string_view::npos;
+    std::size_t resume = 0;
+    while (t < text.size()) {
+      if (p < pattern.size() && pattern[p] == '*') {
+        star = p++;
+        resume = t;
+      } else if (p < pattern.size() && pattern[p] == text[t]) {
+        ++p;
+        ++t;
+      } else if (star != std::string_view::npos) {
+        p = star + 1;
+        t = ++resume;
+      } else {
+        return false;
       }
-      sock_->send(oss.str());
     }
+    while (p < pattern.size() && pattern[p] == '*') {
+      ++p;
+    }
+    return p == pattern.size();
+  }
+
+  // a shared dictionary of compression-dictionary-transport (RFC 9842). clients fetch it from url,
+  // keep it for the paths matching match and announce its hash in Available-Dictionary; responses
+  // to them are compressed with dcz (zstd) or dcb (brotli) against it.
+  struct compression_dictionary {
+    std::shared_ptr<std::string const> content;
+    std::array<std::uint8_t, 32> hash;
+    std::string id;  // the hash as a structured field byte sequence, ":base64:"
+    std::string url;
+    std::string match;
   };
 
-  // TODO
-  std::unordered_map<int, std::string const> response::default_status_messages = {
-      {200, "OK"},
-      {400, "Bad Request"},
-      {404, "Not Found"}};
+  // reads a raw content dictionary. zstd formatted dictionaries are rejected since clients use
+  // the whole file as raw content; nhs-train-dictionary writes raw ones.
+  inline std::shared_ptr<compression_dictionary const> read_compression_dictionary(
+      std::filesystem::path const& path, std::string url, std::string match) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in) {
+      throw std::runtime_error{"cannot read the dictionary " + path.string()};
+    }
+    std::string content{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    if (content.empty() || content.compare(0, 4, "\x37\xa4\x30\xec") == 0) {
+      throw std::runtime_error{"not a raw content dictionary: " + path.string()};
+    }
+    auto dictionary = std::make_shared<compression_dictionary>();
+    dictionary->hash = sha256(content);
+    dictionary->id = ":" +
+                     base64({reinterpret_cast<char const*>(dictionary->hash.data()),
+                             dictionary->hash.size()}) +
+                     ":";
+    dictionary->content = std::make_shared<std::string const>(std::move(content));
+    dictionary->url = std::move(url);
+    dictionary->match = std::move(match);
+    return dictionary;
+  }
 
-  class server {
-    std::thread thread_;
-    std::unordered_map<
-        std::string,
-        std::unordered_map<std::string, std::function<void(request const&, response&)>>>
-        callbacks_;
+  struct compression_options {
+    std::size_t min_size = 1024;
+    // prefixes of the Content-Type values which are compressed
+    std::vector<std::string> types = {"text/",
+                                      "application/json",
+                                      "application/javascript",
+                                      "application/xml",
+                                      "application/wasm",
+                                      "image/svg+xml"};
+    int gzip_level = 6;
+    int zstd_level = 3;
+    int brotli_level = 4;
+    std::size_t memo_capacity = 8 << 20;  // bytes of memoized compressed chunks per thread
+    std::vector<std::shared_ptr<compression_dictionary const>> dictionaries;
+  };
 
-  public:
-    ~server() noexcept {
-      try {
-        if (thread_.joinable()) {
-          thread_.join();
+  // compresses response bodies with deflate and zstd contexts which are created once per thread
+  // and reset for each use. every chunk is compressed into an independent fragment: a raw deflate
+  // run ending with a sync flush, or a zstd frame. such fragments can be concatenated, so the
+  // fragments of immutable shared chunks, like the static segments of a rendered template, are
+  // memoized and only the small dynamic chunks are compressed per response. brotli streams cannot
+  // be concatenated, so br and dcb compress the whole body each time and come after zstd.
+  class content_encoder {
+    enum class coding { gzip, zstd, dcz };
+
+    struct memo_key {
+      char const* data;
+      std::size_t size;
+      coding codec;
+      compression_dictionary const* dictionary;
+
+      bool operator==(memo_key const& other) const noexcept {
+        return data == other.data && size == other.size && codec == other.codec &&
+               dictionary == other.dictionary;
+      }
+    };
+
+    struct memo_hash {
+      std::size_t operator()(memo_key const& key) const noexcept {
+        return std::hash<void const*>{}(key.data) ^ (key.size * 0x9e3779b97f4a7c15ull) ^
+               static_cast<std::size_t>(key.codec) ^ std::hash<void const*>{}(key.dictionary);
+      }
+    };
+
+    // a memoized fragment is valid while the owner of the compressed memory is alive, since the
+    // memory cannot be reused for other content before that.
+    struct memo_entry {
+      std::weak_ptr<std::string const> owner;
+      std::shared_ptr<std::string const> fragment;
+      uLong crc;
+    };
+
+#ifdef NHS_HAVE_ZSTD
+    // a dictionary digested once per thread at the configured level
+    struct zstd_dictionary_context {
+      ::ZSTD_CDict* dictionary = nullptr;
+      ::ZSTD_CCtx* context = nullptr;
+    };
+#endif
+
+    std::shared_ptr<compression_options const> options_;
+    ::z_stream deflate_{};
+    bool deflate_ready_ = false;
+#ifdef NHS_HAVE_ZSTD
+    ::ZSTD_CCtx* zstd_ = nullptr;
+    std::unordered_map<compression_dictionary const*, zstd_dictionary_context> zstd_dictionaries_;
+#endif
+#ifdef NHS_HAVE_BROTLI_DICTIONARY
+    std::unordered_map<compression_dictionary const*, ::BrotliEncoderPreparedDictionary*>
+        brotli_dictionaries_;
+#endif
+    std::unordered_map<memo_key, memo_entry, memo_hash> memo_;
+    std::size_t memo_size_ = 0;
+
+    content_encoder() = default;
+
+    // appends a raw deflate fragment of the inputs which ends on a byte boundary.
+    void deflate_fragment(std::vector<std::string_view> const& inputs, std::string& out) {
+      if (!deflate_ready_) {
+        if (::deflateInit2(&deflate_, options_->gzip_level, Z_DEFLATED, -15, 8,
+                           Z_DEFAULT_STRATEGY) != Z_OK) {
+          throw std::runtime_error{"deflateInit2"};
         }
-      } catch (...) {
+        deflate_ready_ = true;
+      } else {
+        ::deflateReset(&deflate_);
+      }
+      for (std::size_t i = 0; i < inputs.size(); ++i) {
+        deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(inputs[i].data()));
+        deflate_.avail_in = static_cast<uInt>(inputs[i].size());
+        auto const flush = i + 1 == inputs.size() ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        do {
+          auto const used = out.size();
+          out.resize(used + ::deflateBound(&deflate_, deflate_.avail_in) + 16);
+          deflate_.next_out = reinterpret_cast<Bytef*>(out.data() + used);
+          deflate_.avail_out = static_cast<uInt>(out.size() - used);
+          ::deflate(&deflate_, flush);
+          out.resize(out.size() - deflate_.avail_out);
+        } while (deflate_.avail_in > 0 || deflate_.avail_out == 0);
       }
     }
 
-    template <typename Callback>
-    server& get(std::string const& path, Callback&& callback) {
-      callbacks_["GET"][path] = std::forward<Callback>(callback);
-      return *this;
+#ifdef NHS_HAVE_ZSTD
+    ::ZSTD_CCtx* zstd_context(compression_dictionary const* dictionary) {
+      if (dictionary == nullptr) {
+        if (zstd_ == nullptr) {
+          if ((zstd_ = ::ZSTD_createCCtx()) == nullptr) {
+            throw std::bad_alloc{};
+          }
+          ::ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, options_->zstd_level);
+        }
+        return zstd_;
+      }
+      auto& entry = zstd_dictionaries_[dictionary];
+      if (entry.context == nullptr) {
+        entry.dictionary = ::ZSTD_createCDict(dictionary->content->data(),
+                                              dictionary->content->size(), options_->zstd_level);
+        entry.context = ::ZSTD_createCCtx();
+        if (entry.dictionary == nullptr || entry.context == nullptr) {
+          throw std::bad_alloc{};
+        }
+        ::ZSTD_CCtx_refCDict(entry.context, entry.dictionary);
+      }
+      return entry.context;
     }
 
-    void listen(int port) {
-      thread_ = std::thread([&] {
-        try {
-          socket sock{port};
-          sock.connect();
-          sock.listen();
-          while (true) {
-            sock.accept();
-            request req;
-            while (true) {
-              char buffer[256] = {0};
-              auto const recv_size = sock.recv(buffer, sizeof(buffer) - 1);
-              if (recv_size == 0) {
-                break;
-              }
-              if (recv_size < 0) {
-                continue;
-              }
-              req.parse_and_build(buffer, recv_size);
-              if (req.state_ == parse_state::done) {
-                // TODO: get hostname from Host header
-                req.hostname_ = "localhost";
-                break;
-              }
-            }
-            auto const& target_method_callbacks = callbacks_[req.method()];
-            response res{req, sock};
-            for (auto const& [path, cb] : target_method_callbacks) {
-              if (std::regex_match(req.path(), std::regex{path})) {
-                cb(req, res);
-              }
-            }
+    // appends a zstd frame of the inputs. resetting the session keeps a referenced dictionary.
+    void zstd_frame(std::vector<std::string_view> const& inputs,
+                    compression_dictionary const* dictionary,
+                    std::string& out) {
+      auto* const context = zstd_context(dictionary);
+      ::ZSTD_CCtx_reset(context, ZSTD_reset_session_only);
+      for (std::size_t i = 0; i < inputs.size(); ++i) {
+        ::ZSTD_inBuffer in{inputs[i].data(), inputs[i].size(), 0};
+        auto const mode = i + 1 == inputs.size() ? ZSTD_e_end : ZSTD_e_continue;
+        std::size_t remaining;
+        do {
+          auto const used = out.size();
+          out.resize(used + ::ZSTD_compressBound(in.size - in.pos) + 64);
+          ::ZSTD_outBuffer o{out.data() + used, out.size() - used, 0};
+          remaining = ::ZSTD_compressStream2(context, &o, &in, mode);
+          if (::ZSTD_isError(remaining)) {
+            throw std::runtime_error{::ZSTD_getErrorName(remaining)};
           }
-        } catch (std::exception const& ex) {
-          std::cerr << ex.what() << std::endl;
-        } catch (...) {
-          std::cerr << "unknown error" << std::endl;
-        }
-      });
+          out.resize(used + o.pos);
+        } while (in.pos < in.size || (mode == ZSTD_e_end && remaining != 0));
+      }
     }
-  };
-}
+#endif
 
-struct parsed_command {
-  std::string path;
-};
+    void fragment(std::vector<std::string_view> const& inputs,
+                  [[maybe_unused]] coding codec,
+                  [[maybe_unused]] compression_dictionary const* dictionary,
+                  std::string& out) {
+#ifdef NHS_HAVE_ZSTD
+      if (codec != coding::gzip) {
+        zstd_frame(inputs, dictionary, out);
+        return;
+      }
+#endif
+      deflate_fragment(inputs, out);
+    }
+
+    memo_entry const& memoized(shared_slice const& slice,
+                               coding codec,
+                               compression_dictionary const* dictionary) {
+      memo_key const key{slice.view.data(), slice.view.size(), codec, dictionary};
+      auto it = memo_.find(key);
+      if (it != memo_.end() && it->second.owner.lock() == slice.owner) {
+        return it->second;
+      }
+      std::string fragment;
+      this->fragment({slice.view}, codec, dictionary, fragment);
+      if (memo_size_ + fragment.size() > options_->memo_capacity) {
+        memo_.clear();
+        memo_size_ = 0;
+      }
+      memo_size_ += fragment.size();
+      uLong crc = 0;
+      if (codec == coding::gzip) {
+        crc = ::crc32(0, reinterpret_cast<Bytef const*>(slice.view.data()),
+                      static_cast<uInt>(slice.view.size()));
+      }
+      memo_entry entry{slice.owner, std::make_shared<std::string const>(std::move(fragment)), crc};
+      return memo_.insert_or_assign(key, std::move(entry)).first->second;
+    }
+
+    // compresses the body into concatenated fragments, framed as gzip or dcz when needed.
+    buffer_chain fragments(buffer_chain const& body,
+                           coding codec,
+                           compression_dictionary const* dictionary) {
+      auto const gzip = codec == coding::gzip;
+      buffer_chain encoded;
+      uLong crc = ::crc32(0, nullptr, 0);
+      std::vector<std::string_view> run;  // a run of chunks which are not memoized
+      auto const flush_run = [&] {
+        if (run.empty()) {
+          return;
+        }
+        std::string out;
+        fragment(run, codec, dictionary, out);
+        if (gzip) {
+          for (auto const input : run) {
+            crc = ::crc32(crc, reinterpret_cast<Bytef const*>(input.data()),
+                          static_cast<uInt>(input.size()));
+          }
+        }
+        encoded.append(std::move(out));
+        run.clear();
+      };
+      if (gzip) {
+        // gzip header: deflate, no flags, no mtime, unix
+        encoded.append(std::string{"\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10});
+      } else if (codec == coding::dcz) {
+        // a skippable zstd frame carrying the hash of the dictionary
+        std::string header{"\x5e\x2a\x4d\x18\x20\x00\x00\x00", 8};
+        header.append(reinterpret_cast<char const*>(dictionary->hash.data()),
+                      dictionary->hash.size());
+        encoded.append(std::move(header));
+      }
+      for (auto const& c : body.chunks()) {
+        auto const* slice = std::get_if<shared_slice>(&c);
+        if (slice == nullptr) {
+          if (auto const memory = buffer_chain::memory_of(c); !memory.empty()) {
+            run.push_back(memory);
+          }
+          continue;
+        }
+        flush_run();
+        auto const& entry = memoized(*slice, codec, dictionary);
+        if (gzip) {
+          crc = ::crc32_combine(crc, entry.crc, static_cast<z_off_t>(slice->view.size()));
+        }
+        encoded.append_shared(entry.fragment);
+      }
+      flush_run();
+      if (gzip) {
+        // an empty final block and the trailer of the crc and the size, both little endian
+        std::string trailer{"\x03\x00", 2};
+        auto const size = static_cast<std::uint32_t>(body.size());
+        for (auto const value : {static_cast<std::uint32_t>(crc), size}) {
+          for (auto shift = 0; shift < 32; shift += 8) {
+            trailer.push_back(static_cast<char>((value >> shift) & 0xff));
+          }
+        }
+        encoded.append(std::move(trailer));
+      }
+      return encoded;
+    }
+
+#ifdef NHS_HAVE_BROTLI
+    // compresses the whole body into one brotli stream, framed as dcb with a dictionary.
+    buffer_chain brotli(buffer_chain const& body,
+                        [[maybe_unused]] compression_dictionary const* dictionary) {
+      std::unique_ptr<::BrotliEncoderState, void (*)(::BrotliEncoderState*)> state{
+          ::BrotliEncoderCreateInstance(nullptr, nullptr, nullptr),
+          ::BrotliEncoderDestroyInstance};
+      if (!state) {
+        throw std::bad_alloc{};
+      }
+      ::BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_QUALITY,
+                                  static_cast<std::uint32_t>(options_->brotli_level));
+      std::string out;
+#ifdef NHS_HAVE_BROTLI_DICTIONARY
+      if (dictionary != nullptr) {
+        auto& prepared = brotli_dictionaries_[dictionary];
+        if (prepared == nullptr) {
+          prepared = ::BrotliEncoderPrepareDictionary(
+              BROTLI_SHARED_DICTIONARY_RAW, dictionary->content->size(),
+              reinterpret_cast<std::uint8_t const*>(dictionary->content->data()),
+              options_->brotli_level, nullptr, nullptr, nullptr);
+          if (prepared == nullptr) {
+            throw std::bad_alloc{};
+          }
+        }
+        ::BrotliEncoderAttachPreparedDictionary(state.get(), prepared);
+        out.assign("\xff\x44\x43\x42", 4);
+        out.append(reinterpret_cast<char const*>(dictionary->hash.data()),
+                   dictionary->hash.size());
+      }
+#endif
+      auto const& chunks = body.chunks();
+      for (std::size_t i = 0; i < chunks.size(); ++i) {
+        auto const memory = buffer_chain::memory_of(chunks[i]);
+        auto const operation =
+            i + 1 == chunks.size() ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        auto available_in = memory.size();
+        auto const* next_in = reinterpret_cast<std::uint8_t const*>(memory.data());
+        do {
+          auto const used = out.size();
+          out.resize(used + available_in + 1024);
+          auto available_out = out.size() - used;
+          auto* next_out = reinterpret_cast<std::uint8_t*>(out.data() + used);
+          if (!::BrotliEncoderCompressStream(state.get(), operation, &available_in, &next_in,
+                                             &available_out, &next_out, nullptr)) {
+            throw std::runtime_error{"BrotliEncoderCompressStream"};
+          }
+          out.resize(out.size() - available_out);
+        } while (available_in > 0 || ::BrotliEncoderHasMoreOutput(state.get()) ||
+                 (operation == BROTLI_OPERATION_FINISH &&
+                  !::BrotliEncoderIsFinished(state.get())));
+      }
+      buffer_chain encoded;
+      encoded.append(std::move(out));
+      return encoded;
+    }
+#endif
+
+    // returns the dictionary announced by Available-Dictionary when it is configured for the path.
+    compression_dictionary const* available_dictionary(request const& req) const {
+      auto const available = trim(req.header("available-dictionary"));
+      if (available.empty()) {
+        return nullptr;
+      }
+      for (auto const& dictionary : options_->dictionaries) {
+        if (available == dictionary->id && glob_match(dictionary->match, req.path())) {
+          return dictionary.get();
+        }
+      }
+      return nullptr;
+    }
+
+  public:
+    content_encoder(content_encoder const&) = delete;
+    content_encoder& operator=(content_encoder const&) = delete;
+
+    ~content_encoder() {
+      if (deflate_ready_) {
+        ::deflateEnd(&deflate_);
+      }
+#ifdef NHS_HAVE_ZSTD
+      ::ZSTD_freeCCtx(zstd_);
+      for (auto const& [dictionary, entry] : zstd_dictionaries_) {
+        ::ZSTD_freeCCtx(entry.context);
+        ::ZSTD_freeCDict(entry.dictionary);
+      }
+#endif
+#ifdef NHS_HAVE_BROTLI_DICTIONARY
+      for (auto const& [dictionary, prepared] : brotli_dictionaries_) {
+        ::BrotliEncoderDestroyPreparedDictionary(prepared);
+      }
+#endif
+    }
+
+    static content_encoder& local() {
+      thread_local content_encoder encoder;
+      return encoder;
+    }
+
+    void configure(std::shared_ptr<compression_options const> options) {
+      options_ = std::move(options);
+    }
+
+    // returns true for the bodies which may be compressed, whether the client accepts it or not.
+    bool compressible(std::string_view content_type, buffer_chain const& body) const {
+      if (!options_ || body.size() < options_->min_size) {
+        return false;
+      }
+      for (auto const& c : body.chunks()) {
+        if (std::holds_alternative<file_range>(c)) {
+          return false;
+        }
+      }
+      return std::any_of(options_->types.begin(), options_->types.end(),
+                         [&](std::string const& type) {
+                           return content_type.substr(0, type.size()) == type;
+                         });
+    }
+
+    // the request headers which select the coding of a compressible response.
+    std::string_view vary() const noexcept {
+      return options_->dictionaries.empty() ? "Accept-Encoding"
+                                            : "Accept-Encoding, Available-Dictionary";
+    }
+
+    // appends a Link header for each dictionary of the path which the client does not have yet.
+    void advertise(request const& req, std::string& head) const {
+      auto const available = trim(req.header("available-dictionary"));
+      for (auto const& dictionary : options_->dictionaries) {
+        if (available != dictionary->id && glob_match(dictionary->match, req.path())) {
+          head.append("Link: <")
+              .append(dictionary->url)
+              .append(">; rel=\"compression-dictionary\"\r\n");
+        }
+      }
+    }
+
+    // compresses a compressible body with a coding the request accepts and returns the coding, or
+    // an empty view when the body is left as it is.
+    std::string_view encode(request const& req, buffer_chain& body) {
+      auto const accept = req.header("accept-encoding");
+      if (accept.empty()) {
+        return {};
+      }
+      [[maybe_unused]] auto const* dictionary = available_dictionary(req);
+#ifdef NHS_HAVE_ZSTD
+      if (dictionary != nullptr && accept_quality(accept, "dcz") > 0) {
+        body = fragments(body, coding::dcz, dictionary);
+        return "dcz";
+      }
+#endif
+#ifdef NHS_HAVE_BROTLI_DICTIONARY
+      if (dictionary != nullptr && accept_quality(accept, "dcb") > 0) {
+        body = brotli(body, dictionary);
+        return "dcb";
+      }
+#endif
+#ifdef NHS_HAVE_ZSTD
+      if (accept_quality(accept, "zstd") > 0) {
+        body = fragments(body, coding::zstd, nullptr);
+        return "zstd";
+      }
+#endif
+#ifdef NHS_HAVE_BROTLI
+      if (accept_quality(accept, "br") > 0) {
+        body = brotli(body, nullptr);
+        return "br";
+      }
+#endif
+      if (accept_quality(accept, "gzip") > 0) {
+        body = fragments(body, coding::gzip, nullptr);
+        return "gzip";
+      }
+      return {};
+    }
+  };
+
+  // a thread running the tasks posted to it one at a time, for work which must not hold up an
+  // event loop. an exception thrown by a task is logged. the tasks still queued are run before the
+  // thread is joined.
+  class worker {
+    std::mutex mutex_;
+    std::condition_variable posted_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::thread thread_;  // started last, once the queue exists
+
+    void run() {
+      while (true) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock{mutex_};
+          posted_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+          if (tasks_.empty()) {
+            return;
+          }
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+        }
+        try {
+          task();
+        } catch (std::exception const& ex) {
+          std::cerr << ex.what() << std::endl;
+        }
+      }
+    }
+
+  public:
+    // init runs on the thread before the first task, to set up its thread local state.
+    explicit worker(std::function<void()> init = {})
+        : thread_{[this, init = std::move(init)] {
+            if (init) {
+              init();
+            }
+            run();
+          }} {
+    }
+
+    worker(worker const&) = delete;
+    worker& operator=(worker const&) = delete;
+
+    ~worker() {
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+      }
+      posted_.notify_one();
+      thread_.join();
+    }
+
+    void post(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        tasks_.push_back(std::move(task));
+      }
+      posted_.notify_one();
+    }
+  };
+
+  // a response serialized without the default headers and Connection: the status line, the
+  // headers and the body, which is in a file range instead when it is sent from disk.
+  struct cached_response {
+    std::shared_ptr<std::string const> bytes;
+    std::size_t status_end;   // the end of the status line
+    std::size_t headers_end;  // the end of the headers, where the body starts
+    std::chrono::steady_clock::time_point expires;
+    file_range body_file;
+  };
+
+  struct segment_store_options {
+    std::filesystem::path directory;
+    std::size_t segment_size = 64 << 20;
+    std::size_t segments = 16;  // the oldest segment is deleted to keep at most this many
+    // bytes of keys and responses waiting to be written. the ones stored beyond it are dropped.
+    std::size_t queue_capacity = 16 << 20;
+  };
+
+  // the disk tier of cached responses. records are appended to fixed size segment files which are
+  // mapped read-only to look keys up, and bodies are sent from the segment with sendfile(2). the
+  // index of key hashes is rebuilt by scanning the segments at startup, so a restart keeps the
+  // cache warm. shared by all event loops, which only queue the records: a writer thread appends
+  // them, and lookups find the queued ones in memory meanwhile.
+  class segment_store {
+    static constexpr std::uint32_t magic = 0x4453484e;  // "NHSD"
+
+    enum record_kind : std::uint32_t { response_record, purge_record };
+
+    // followed by the key, the tags separated by spaces and the bytes. a purge record has only the
+    // tags, and the scan at startup drops the responses of its tags which were written before it.
+    struct record_header {
+      std::uint32_t magic;
+      std::uint32_t key_size;
+      std::uint64_t bytes_size;
+      std::uint32_t status_end;
+      std::uint32_t headers_end;
+      std::int64_t expires;  // milliseconds since the unix epoch
+      std::uint32_t tags_size;
+      std::uint32_t kind;
+      std::uint64_t checksum;  // of the rest of the record, to find a torn one after a crash
+    };
+
+    struct segment {
+      std::filesystem::path path;
+      std::uint64_t id = 0;
+      std::shared_ptr<file const> source;
+      char const* data = nullptr;
+      std::size_t size = 0;
+      std::size_t end = 0;  // where the next record is appended
+
+      segment() = default;
+      segment(segment const&) = delete;
+      segment& operator=(segment const&) = delete;
+
+      ~segment() {
+        if (data != nullptr) {
+          ::munmap(const_cast<char*>(data), size);
+        }
+      }
+    };
+
+    struct location {
+      std::shared_ptr<segment> where;
+      std::size_t offset;  // of the record header
+    };
+
+    struct queued {
+      cached_response value;
+      std::vector<std::string> tags;
+    };
+
+    std::mutex mutex_;
+    segment_store_options options_;
+    std::deque<std::shared_ptr<segment>> segments_;  // the oldest first; the last is appended to
+    std::unordered_map<std::uint64_t, location> index_;
+    std::unordered_map<std::string, std::vector<std::uint64_t>> tagged_;  // key hashes by tag
+    std::unordered_map<std::string, queued> queued_;  // stored and not written yet
+    std::size_t queued_size_ = 0;
+    worker writer_;  // the only thread appending, declared last so that it stops first
+
+    static std::int64_t wall_now() noexcept {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+          .count();
+    }
+
+    std::shared_ptr<segment> open_segment(std::uint64_t id, bool create) const {
+      char name[24];
+      std::snprintf(name, sizeof(name), "%016llx.seg", static_cast<unsigned long long>(id));
+      auto s = std::make_shared<segment>();
+      s->path = options_.directory / name;
+      s->id = id;
+      auto const fd = ::open(s->path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+      if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "open " + s->path.string()};
+      }
+      s->source = std::make_shared<file const>(fd);
+      if (create && ::ftruncate(fd, static_cast<::off_t>(options_.segment_size)) != 0) {
+        throw std::system_error{errno, std::generic_category(), "ftruncate"};
+      }
+      struct ::stat st;
+      if (::fstat(fd, &st) != 0) {
+        throw std::system_error{errno, std::generic_category(), "fstat"};
+      }
+      s->size = static_cast<std::size_t>(st.st_size);
+      if (s->size > 0) {
+        auto* const data = ::mmap(nullptr, s->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+          throw std::system_error{errno, std::generic_category(), "mmap"};
+        }
+        s->data = static_cast<char const*>(data);
+      }
+      return s;
+    }
+
+    // whether a record fits in the bytes left of its segment. the sizes come from the disk, so
+    // each is checked against what is left before any of them is added up.
+    static bool fits(record_header const& header, std::size_t remaining) noexcept {
+      if (remaining < sizeof(header) || header.key_size > remaining - sizeof(header)) {
+        return false;
+      }
+      remaining -= sizeof(header) + header.key_size;
+      if (header.tags_size > remaining) {
+        return false;
+      }
+      remaining -= header.tags_size;
+      return header.bytes_size <= remaining && header.headers_end <= header.bytes_size &&
+             header.status_end <= header.headers_end;
+    }
+
+    // indexes the records of a segment up to the first one which is missing or torn.
+    void scan(std::shared_ptr<segment> const& s) {
+      auto const now = wall_now();
+      std::size_t offset = 0;
+      while (offset + sizeof(record_header) <= s->size) {
+        record_header header;
+        std::memcpy(&header, s->data + offset, sizeof(header));
+        if (header.magic != magic || !fits(header, s->size - offset) ||
+            (header.kind == response_record && header.key_size == 0)) {
+          break;
+        }
+        auto const total = sizeof(header) + header.key_size + header.tags_size +
+                           static_cast<std::size_t>(header.bytes_size);
+        std::string_view const key{s->data + offset + sizeof(header), header.key_size};
+        std::string_view const tags{key.data() + key.size(), header.tags_size};
+        std::string_view const bytes{tags.data() + tags.size(),
+                                     static_cast<std::size_t>(header.bytes_size)};
+        if (hash64(bytes, hash64(tags, hash64(key))) != header.checksum) {
+          break;
+        }
+        if (header.kind == purge_record) {
+          forget(std::string{tags});
+        } else if (header.expires > now) {
+          index(key, tags, location{s, offset});
+        }
+        offset += total;
+      }
+      s->end = offset;
+    }
+
+    void index(std::string_view key, std::string_view tags, location where) {
+      auto const hash = hash64(key);
+      index_.insert_or_assign(hash, std::move(where));
+      while (!tags.empty()) {
+        auto const space = tags.find(' ');
+        tagged_[std::string{tags.substr(0, space)}].push_back(hash);
+        tags.remove_prefix(space == std::string_view::npos ? tags.size() : space + 1);
+      }
+    }
+
+    std::size_t forget(std::string const& tag) {
+      auto const it = tagged_.find(tag);
+      if (it == tagged_.end()) {
+        return 0;
+      }
+      std::size_t forgotten = 0;
+      for (auto const hash : it->second) {
+        forgotten += index_.erase(hash);
+      }
+      tagged_.erase(it);
+      return forgotten;
+    }
+
+    // appends a record to the last segment on the writer thread, starting a new one when it does
+    // not fit. the lock is not held while writing, so lookups do not wait for the disk. returns
+    // where the record is, or nullopt when it is not written.
+    std::optional<location> append(::iovec const* iov, int count, std::size_t total) {
+      std::shared_ptr<segment> s;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (segments_.empty() || segments_.back()->end + total > segments_.back()->size) {
+          roll();
+        }
+        s = segments_.back();
+      }
+      // only this thread moves the end, so it is not taken by another record meanwhile
+      auto const offset = s->end;
+      if (::pwritev(s->source->fd(), iov, count, static_cast<::off_t>(offset)) !=
+          static_cast<::ssize_t>(total)) {
+        return std::nullopt;
+      }
+      s->end += total;
+      return location{std::move(s), offset};
+    }
+
+    static std::size_t charge(std::string const& key, queued const& q) noexcept {
+      return key.size() + q.value.bytes->size();
+    }
+
+    // writes a queued response on the writer thread. it is indexed unless it has been purged or
+    // stored again meanwhile, in which case the newer one is written by its own task.
+    void write(std::string const& key) {
+      queued q;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto const it = queued_.find(key);
+        if (it == queued_.end()) {
+          return;
+        }
+        q = it->second;
+      }
+      auto const now = std::chrono::steady_clock::now();
+      std::string_view const bytes{*q.value.bytes};
+      std::string joined;
+      for (auto const& tag : q.tags) {
+        joined.append(joined.empty() ? "" : " ").append(tag);
+      }
+      record_header header{magic,
+                           static_cast<std::uint32_t>(key.size()),
+                           bytes.size(),
+                           static_cast<std::uint32_t>(q.value.status_end),
+                           static_cast<std::uint32_t>(q.value.headers_end),
+                           wall_now() + std::chrono::duration_cast<std::chrono::milliseconds>(
+                                            q.value.expires - now)
+                                            .count(),
+                           static_cast<std::uint32_t>(joined.size()),
+                           response_record,
+                           hash64(bytes, hash64(joined, hash64(key)))};
+      auto const total = sizeof(header) + key.size() + joined.size() + bytes.size();
+      std::optional<location> written;
+      if (q.value.expires > now && total <= options_.segment_size) {
+        ::iovec const iov[] = {{&header, sizeof(header)},
+                               {const_cast<char*>(key.data()), key.size()},
+                               {joined.data(), joined.size()},
+                               {const_cast<char*>(bytes.data()), bytes.size()}};
+        written = append(iov, std::size(iov), total);
+      }
+      std::lock_guard<std::mutex> lock{mutex_};
+      auto const it = queued_.find(key);
+      if (it == queued_.end() || it->second.value.bytes != q.value.bytes) {
+        return;
+      }
+      if (written) {
+        index(key, joined, std::move(*written));
+      }
+      queued_size_ -= charge(key, it->second);
+      queued_.erase(it);
+    }
+
+    // starts a new segment and deletes the oldest ones beyond the limit with their index entries.
+    void roll() {
+      segments_.push_back(open_segment(segments_.empty() ? 1 : segments_.back()->id + 1, true));
+      auto dropped = false;
+      while (segments_.size() > std::max<std::size_t>(options_.segments, 1)) {
+        auto const oldest = std::move(segments_.front());
+        segments_.pop_front();
+        for (auto it = index_.begin(); it != index_.end();) {
+          it = it->second.where == oldest ? index_.erase(it) : std::next(it);
+        }
+        ::unlink(oldest->path.c_str());
+        dropped = true;
+      }
+      if (!dropped) {
+        return;
+      }
+      // the tags forget the hashes which are gone, so they do not grow without bound
+      for (auto it = tagged_.begin(); it != tagged_.end();) {
+        auto& hashes = it->second;
+        hashes.erase(std::remove_if(hashes.begin(), hashes.end(),
+                                    [this](std::uint64_t hash) { return index_.count(hash) == 0; }),
+                     hashes.end());
+        it = hashes.empty() ? tagged_.erase(it) : std::next(it);
+      }
+    }
+
+  public:
+    explicit segment_store(segment_store_options options) : options_{std::move(options)} {
+      std::filesystem::create_directories(options_.directory);
+      std::vector<std::uint64_t> ids;
+      for (auto const& entry : std::filesystem::directory_iterator{options_.directory}) {
+        auto const name = entry.path().filename().string();
+        std::uint64_t id = 0;
+        if (entry.path().extension() == ".seg" &&
+            std::from_chars(name.data(), name.data() + name.size() - 4, id, 16).ec == std::errc{}) {
+          ids.push_back(id);
+        }
+      }
+      std::sort(ids.begin(), ids.end());
+      for (auto const id : ids) {
+        segments_.push_back(open_segment(id, false));
+        scan(segments_.back());
+      }
+    }
+
+    // queues a response whose body is in memory for the writer thread, unless the queue is full.
+    // the old record of the key is left in its segment and goes away with it.
+    void store(std::string const& key,
+               cached_response const& value,
+               std::vector<std::string> const& tags) {
+      if (key.empty()) {
+        return;
+      }
+      queued q{value, tags};
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto const it = queued_.find(key);
+        auto const replaced = it != queued_.end() ? charge(key, it->second) : 0;
+        if (queued_size_ - replaced + charge(key, q) > options_.queue_capacity) {
+          return;
+        }
+        queued_size_ = queued_size_ - replaced + charge(key, q);
+        queued_.insert_or_assign(key, std::move(q));
+      }
+      writer_.post([this, key] { write(key); });
+    }
+
+    // forgets the records and the queued responses of a tag, and returns how many there were. a
+    // purge record keeps them forgotten after a restart, including those being written now.
+    std::size_t purge(std::string const& tag) {
+      std::size_t purged = 0;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        purged = forget(tag);
+        for (auto it = queued_.begin(); it != queued_.end();) {
+          auto const& tags = it->second.tags;
+          if (std::find(tags.begin(), tags.end(), tag) == tags.end()) {
+            ++it;
+            continue;
+          }
+          queued_size_ -= charge(it->first, it->second);
+          it = queued_.erase(it);
+          ++purged;
+        }
+      }
+      if (purged == 0 || tag.find(' ') != std::string::npos) {
+        return purged;
+      }
+      writer_.post([this, tag] {
+        record_header header{magic, 0, 0, 0, 0, 0, static_cast<std::uint32_t>(tag.size()),
+                             purge_record, hash64({}, hash64(tag, hash64({})))};
+        ::iovec const iov[] = {{&header, sizeof(header)},
+                               {const_cast<char*>(tag.data()), tag.size()}};
+        append(iov, std::size(iov), sizeof(header) + tag.size());
+      });
+      return purged;
+    }
+
+    // returns a response which has not expired. a queued one is returned as it was stored. for a
+    // written one, the status line and the headers are copied from the mapping, and the body is a
+    // range of the segment file.
+    std::optional<cached_response> find(std::string const& key) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (auto const it = queued_.find(key); it != queued_.end()) {
+        if (it->second.value.expires > std::chrono::steady_clock::now()) {
+          return it->second.value;
+        }
+        return std::nullopt;
+      }
+      auto const it = index_.find(hash64(key));
+      if (it == index_.end()) {
+        return std::nullopt;
+      }
+      auto const& [where, offset] = it->second;
+      record_header header;
+      std::memcpy(&header, where->data + offset, sizeof(header));
+      auto const* const record_key = where->data + offset + sizeof(header);
+      if (!fits(header, where->size - offset) || header.key_size != key.size() ||
+          std::memcmp(record_key, key.data(), key.size()) != 0) {
+        return std::nullopt;
+      }
+      auto const remaining = header.expires - wall_now();
+      if (remaining <= 0) {
+        index_.erase(it);
+        return std::nullopt;
+      }
+      auto const* const bytes = record_key + header.key_size + header.tags_size;
+      auto const body_offset =
+          offset + sizeof(header) + header.key_size + header.tags_size + header.headers_end;
+      return cached_response{
+          std::make_shared<std::string const>(bytes, header.headers_end),
+          header.status_end,
+          header.headers_end,
+          std::chrono::steady_clock::now() + std::chrono::milliseconds{remaining},
+          file_range{where->source, static_cast<::off_t>(body_offset),
+                     static_cast<std::size_t>(header.bytes_size - header.headers_end)}};
+    }
+  };
+
+  struct microcache_options {
+    std::chrono::milliseconds ttl{1000};
+    // request headers whose values are a part of the key besides the method, the host and the URL
+    std::vector<std::string> vary = {"accept-encoding", "available-dictionary"};
+    std::size_t capacity = 16 << 20;  // bytes of cached keys and responses
+    // after the TTL, an entry is still sent for this long while one refresh runs in the background
+    std::chrono::milliseconds stale_while_revalidate{0};
+    // after the TTL, an entry whose refresh failed is still sent for this long. a refresh is only
+    // started within stale_while_revalidate, so this has no effect while that is 0.
+    std::chrono::milliseconds stale_if_error{0};
+  };
+
+  // fully serialized 200 responses of a route, kept for a short TTL. an entry holds the status
+  // line, the headers and the body in one buffer without the default headers and Connection, so
+  // a hit queues slices of it around the current Date and nothing is rendered or copied. shared
+  // by all event loops. a miss is rendered once: the requests which miss the same key while it is
+  // rendered are parked by their event loops and answered with the result, instead of calling
+  // the handler too or blocking their loops. a stale entry is sent at
+  // once and a single refresh replaces it later; while refreshes fail, it is kept a while longer.
+  // with a segment store, the least recently used fresh entries are spilled to disk instead of
+  // being dropped when memory is short, and fresh ones found there are sent from the segment.
+  class microcache {
+  public:
+    using clock = std::chrono::steady_clock;
+    using entry = cached_response;
+    // called with the result of a flight when it lands, or nullopt when nothing was stored
+    using waiter = std::function<void(std::optional<entry>)>;
+
+  private:
+    // a miss being rendered by one event loop
+    struct flight {
+      std::optional<entry> result;
+      std::vector<waiter> waiters;
+    };
+
+    struct slot {
+      entry value;
+      std::vector<std::string> tags;
+      std::list<std::string const*>::iterator used;  // the key in lru_
+      bool refreshing = false;  // a refresh has been handed out and has not ended
+      bool failed = false;      // the last refresh did not store a response
+    };
+
+    mutable std::mutex mutex_;
+    microcache_options options_;
+    std::unordered_map<std::string, slot> entries_;
+    std::list<std::string const*> lru_;  // keys of entries_, the most recently used first
+    std::unordered_map<std::string, flight> flights_;
+    std::unordered_map<std::string, std::unordered_set<std::string>> tagged_;  // keys by tag
+    std::size_t size_ = 0;
+    segment_store* disk_ = nullptr;
+
+    // the time until which a slot may be sent stale
+    clock::time_point stale_until(slot const& s) const noexcept {
+      auto until = s.value.expires + options_.stale_while_revalidate;
+      if (s.failed) {
+        until = std::max(until, s.value.expires + options_.stale_if_error);
+      }
+      return until;
+    }
+
+    void erase(std::unordered_map<std::string, slot>::iterator it) {
+      for (auto const& tag : it->second.tags) {
+        if (auto const tagged = tagged_.find(tag); tagged != tagged_.end()) {
+          tagged->second.erase(it->first);
+          if (tagged->second.empty()) {
+            tagged_.erase(tagged);
+          }
+        }
+      }
+      size_ -= it->first.size() + it->second.value.bytes->size();
+      lru_.erase(it->second.used);
+      entries_.erase(it);
+    }
+
+  public:
+    explicit microcache(microcache_options options) : options_{std::move(options)} {
+    }
+
+    std::chrono::milliseconds ttl() const noexcept {
+      return options_.ttl;
+    }
+
+    void spill_to(segment_store* disk) noexcept {
+      disk_ = disk;
+    }
+
+    std::string key(request const& req) const {
+      std::string key;
+      key.append(req.method())
+          .append(1, '\0')
+          .append(req.http_version())
+          .append(1, '\0')
+          .append(req.header("host"))
+          .append(1, '\0')
+          .append(req.original_url());
+      for (auto const& header : options_.vary) {
+        key.append(1, '\0').append(req.header(header));
+      }
+      return key;
+    }
+
+    // returns a fresh entry or a stale one. returns nullopt and sets leader when the caller has to
+    // render the response; it then calls land(key) once the response is sent, whether it was
+    // stored or not. when the key is being rendered already, join is called under the lock and
+    // the waiter it returns gets the result from the thread landing the flight; nullopt is
+    // returned without leader. the caller renders its own response when join returns no waiter.
+    // refresh is set for one caller of a stale entry, which calls refreshed(key) after rendering
+    // the response again.
+    template <typename Join>
+    std::optional<entry> find(std::string const& key, bool& leader, bool& refresh, Join&& join) {
+      leader = false;
+      refresh = false;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto const now = clock::now();
+        if (auto const it = entries_.find(key); it != entries_.end()) {
+          auto& s = it->second;
+          lru_.splice(lru_.begin(), lru_, s.used);
+          if (s.value.expires > now) {
+            return s.value;
+          }
+          if (stale_until(s) > now) {
+            refresh = !s.refreshing;
+            s.refreshing = true;
+            return s.value;
+          }
+        }
+      }
+      if (disk_ != nullptr) {
+        if (auto hit = disk_->find(key)) {
+          return hit;
+        }
+      }
+      std::lock_guard<std::mutex> lock{mutex_};
+      auto const [it, inserted] = flights_.try_emplace(key);
+      if (inserted) {
+        leader = true;
+      } else if (waiter w = join()) {
+        it->second.waiters.push_back(std::move(w));
+      }
+      return std::nullopt;
+    }
+
+    // ends the flight of a key and hands its result to the waiters.
+    void land(std::string const& key) {
+      flight landed;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto const it = flights_.find(key);
+        if (it == flights_.end()) {
+          return;
+        }
+        landed = std::move(it->second);
+        flights_.erase(it);
+      }
+      for (auto& w : landed.waiters) {
+        w(landed.result);
+      }
+    }
+
+    // ends a refresh. a successful one has replaced the slot already, so a slot which is still
+    // refreshing failed.
+    void refreshed(std::string const& key) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (auto const it = entries_.find(key); it != entries_.end() && it->second.refreshing) {
+        it->second.refreshing = false;
+        it->second.failed = true;
+      }
+    }
+
+    // when the capacity is reached, the least recently used entries are evicted down to 3/4 of
+    // it, and the fresh ones among them are handed to the segment store after the lock is
+    // released. the waiters of the flight of the key get the entry even if it is not kept.
+    void insert(std::string const& key, entry value, std::vector<std::string> tags = {}) {
+      auto const charge = key.size() + value.bytes->size();
+      std::vector<std::pair<std::string, slot>> spilled;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (auto const it = flights_.find(key); it != flights_.end()) {
+          it->second.result = value;
+        }
+        if (charge > options_.capacity) {
+          return;
+        }
+        if (auto const it = entries_.find(key); it != entries_.end()) {
+          erase(it);
+        }
+        auto const now = clock::now();
+        if (size_ + charge > options_.capacity) {
+          while (!lru_.empty() && size_ + charge > options_.capacity - options_.capacity / 4) {
+            auto const it = entries_.find(*lru_.back());
+            if (disk_ != nullptr && it->second.value.expires > now) {
+              spilled.emplace_back(it->first, it->second);
+            }
+            erase(it);
+          }
+        }
+        for (auto const& tag : tags) {
+          tagged_[tag].insert(key);
+        }
+        size_ += charge;
+        auto const it = entries_.emplace(key, slot{std::move(value), std::move(tags), {}}).first;
+        lru_.push_front(&it->first);
+        it->second.used = lru_.begin();
+      }
+      for (auto const& [spilled_key, spilled] : spilled) {
+        disk_->store(spilled_key, spilled.value, spilled.tags);
+      }
+    }
+
+    // drops the entries of a tag from memory and disk, and returns how many there were.
+    std::size_t purge(std::string const& tag) {
+      std::size_t purged = 0;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (auto const tagged = tagged_.find(tag); tagged != tagged_.end()) {
+          auto const keys = std::move(tagged->second);
+          tagged_.erase(tagged);
+          for (auto const& key : keys) {
+            if (auto const it = entries_.find(key); it != entries_.end()) {
+              erase(it);
+              ++purged;
+            }
+          }
+        }
+      }
+      return purged + (disk_ != nullptr ? disk_->purge(tag) : 0);
+    }
+  };
+
+  // headers set by the handler share the arena of the request. the serialized response is owned by
+  // the output queue, since it is written after the arena is released.
+  class response {
+    request const* request_ = nullptr;
+    output_queue* output_ = nullptr;
+    std::pmr::unordered_map<std::pmr::string, std::pmr::string> headers_;
+    int status_ = 200;
+    std::pmr::string status_message_;
+    std::shared_ptr<std::string const> header_block_;
+    bool etag_ = false;
+    bool sent_ = false;
+    microcache* cache_ = nullptr;
+    std::string cache_key_;
+    std::vector<std::string> surrogate_keys_;
+
+    // stores a 200 with the whole body in memory unless it is private to the client.
+    void store(std::string const& head,
+               std::size_t status_end,
+               std::size_t headers_begin,
+               std::size_t headers_end,
+               buffer_chain const& body) {
+      auto const control = find_header("cache-control");
+      if (status_ != 200 || request_->method() != "GET" || !find_header("set-cookie").empty() ||
+          control.find("no-store") != std::string_view::npos ||
+          control.find("private") != std::string_view::npos) {
+        return;
+      }
+      auto bytes = std::make_shared<std::string>();
+      bytes->reserve(head.size() + body.size());
+      bytes->append(head, 0, status_end).append(head, headers_begin, headers_end - headers_begin);
+      for (auto const& c : body.chunks()) {
+        if (std::holds_alternative<file_range>(c)) {
+          return;
+        }
+        bytes->append(buffer_chain::memory_of(c));
+      }
+      auto const status_length = status_end;
+      auto const headers_length = status_end + headers_end - headers_begin;
+      cache_->insert(cache_key_,
+                     microcache::entry{std::move(bytes), status_length, headers_length,
+                                       microcache::clock::now() + cache_->ttl(), {}},
+                     std::move(surrogate_keys_));
+    }
+
+    static std::unordered_map<int, std::string const> default_status_messages;
+
+    std::pmr::string lower(std::string_view header) const {
+      std::pmr::string lower_header{header, headers_.get_allocator()};
+      std::transform(lower_header.begin(), lower_header.end(), lower_header.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      return lower_header;
+    }
+
+    // returns a header value set by set_header or in the header block.
+    // a strong ETag stands for the identity bytes, so a body compressed on the fly gets a weak one.
+    // the tag is changed where it was set, in the headers or in a copy of the header block.
+    void weaken_etag() {
+      if (auto const it = headers_.find(std::pmr::string{"etag", headers_.get_allocator()});
+          it != headers_.end()) {
+        if (!it->second.empty() && it->second.front() == '"') {
+          it->second.insert(0, "W/");
+        }
+        return;
+      }
+      if (!header_block_) {
+        return;
+      }
+      auto const tag = block_header(*header_block_, "etag");
+      if (!tag.empty() && tag.front() == '"') {
+        auto block = *header_block_;
+        block.insert(static_cast<std::size_t>(tag.data() - header_block_->data()), "W/");
+        header_block_ = std::make_shared<std::string const>(std::move(block));
+      }
+    }
+
+    std::string_view find_header(std::string_view lower_header) const {
+      if (auto const it = headers_.find(std::pmr::string{lower_header, headers_.get_allocator()});
+          it != headers_.end()) {
+        return it->second;
+      }
+      return header_block_ ? block_header(*header_block_, lower_header) : std::string_view{};
+    }
+
+    // the status line of a 304 in the protocol of the request.
+    std::string not_modified_line() const {
+      std::string line;
+      line.append(request_->protocol())
+          .append("/")
+          .append(request_->http_version())
+          .append(" 304 Not Modified\r\n");
+      return line;
+    }
+
+  public:
+    response(request const& request, output_queue& output)
+        : request_{&request},
+          output_{&output},
+          headers_{request.arena()},
+          status_message_{request.arena()} {
+    }
+
+    // the headers set by the handler, keyed by their lowercase names. they are changed by
+    // set_header, which takes any string.
+    std::pmr::unordered_map<std::pmr::string, std::pmr::string> const& headers() const noexcept {
+      return headers_;
+    }
+
+    void set_header(std::string_view header, std::string_view value) {
+      headers_.insert_or_assign(lower(header), std::pmr::string{value, headers_.get_allocator()});
+    }
+
+    // throws std::out_of_range when the header is not set.
+    std::string_view get_header(std::string_view header) const {
+      return headers_.at(lower(header));
+    }
+
+    response& status(int status) {
+      status_ = status;
+      return *this;
+    }
+
+    response& status_message(std::string_view message) {
+      status_message_ = message;
+      return *this;
+    }
+
+    bool sent() const noexcept {
+      return sent_;
+    }
+
+    // sets pre-serialized header lines, each terminated by CRLF, which are copied into the header
+    // at once. a Content-Type default is not added when a block is set.
+    response& header_block(std::shared_ptr<std::string const> block) noexcept {
+      header_block_ = std::move(block);
+      return *this;
+    }
+
+    // stores the response in a microcache under key when it is sent.
+    response& cache_in(microcache& cache, std::string key) {
+      cache_ = &cache;
+      cache_key_ = std::move(key);
+      return *this;
+    }
+
+    // tags the response in a microcache with space separated keys, like a Surrogate-Key header,
+    // so that purging any of them drops it. the keys are not sent to the client.
+    response& surrogate_key(std::string_view keys) {
+      while (!keys.empty()) {
+        auto const space = keys.find(' ');
+        if (auto const key = keys.substr(0, space); !key.empty()) {
+          surrogate_keys_.emplace_back(key);
+        }
+        keys.remove_prefix(space == std::string_view::npos ? keys.size() : space + 1);
+      }
+      return *this;
+    }
+
+    // sends a response of a microcache with the current default headers, or its 304 when the
+    // validators of a conditional request match the cached ETag or Last-Modified.
+    void send(microcache::entry const& cached) {
+      std::string_view const bytes{*cached.bytes};
+      auto const headers = bytes.substr(cached.status_end, cached.headers_end - cached.status_end);
+      auto const unmodified = not_modified(*request_, block_header(headers, "etag"),
+                                           block_header(headers, "last-modified"));
+      buffer_chain chain;
+      if (unmodified) {
+        chain.append(not_modified_line());
+      } else {
+        chain.append_shared(cached.bytes, bytes.substr(0, cached.status_end));
+      }
+      chain.append(std::string{header_preamble::local().block()});
+      chain.append_shared(cached.bytes, headers);
+      chain.append_view(request_->keep_alive() ? "Connection: Keep-Alive\r\n\r\n"
+                                               : "Connection: close\r\n\r\n");
+      if (unmodified) {
+        // a 304 has no body
+      } else if (cached.body_file.source) {
+        chain.append_file(cached.body_file);
+      } else if (cached.headers_end < bytes.size()) {
+        chain.append_shared(cached.bytes, bytes.substr(cached.headers_end));
+      }
+      output_->push(std::move(chain));
+      sent_ = true;
+    }
+
+    // sends a weak ETag hashed from the body and answers the requests which have it with 304.
+    response& etag() noexcept {
+      etag_ = true;
+      return *this;
+    }
+
+    // the body is copied, since it is written after the handler returns.
+    void send(std::string_view body) {
+      buffer_chain chain;
+      chain.append(std::string{body});
+      send(std::move(chain));
+    }
+
+    // headers are serialized into their own buffer and the body chunks are queued as they are.
+    // nothing is written here; the event loop flushes the connection once per iteration.
+    void send(buffer_chain body) {
+      if (status_ == 200 && etag_ && find_header("etag").empty()) {
+        std::uint64_t hash = 0;
+        auto hashed = true;
+        for (auto const& c : body.chunks()) {
+          hashed = hashed && !std::holds_alternative<file_range>(c);
+          hash = hash64(buffer_chain::memory_of(c), hash);
+        }
+        if (hashed) {
+          char tag[24] = "W/\"";
+          auto const end = std::to_chars(tag + 3, tag + sizeof(tag) - 1, hash, 16).ptr;
+          *end = '"';
+          set_header("ETag", std::string{tag, end + 1});
+        }
+      }
+      std::string_view coding;
+      content_encoder* compressed = nullptr;
+      if (status_ == 200 && !body.empty() && find_header("content-encoding").empty()) {
+        auto const type = find_header("content-type");
+        auto& encoder = content_encoder::local();
+        if (encoder.compressible(type.empty() ? "text/html" : type, body)) {
+          compressed = &encoder;
+        }
+      }
+      // a response being cached is built whole, and a matching client gets its 304 after
+      auto const unmodified = status_ == 200 && not_modified(*request_, find_header("etag"),
+                                                             find_header("last-modified"));
+      if (unmodified && cache_ == nullptr) {
+        status_ = 304;
+        body = buffer_chain{};
+      } else if (compressed != nullptr) {
+        coding = compressed->encode(*request_, body);
+      }
+      if (!coding.empty()) {
+        weaken_etag();
+      }
+      auto const default_message = default_status_messages.find(status_);
+      std::string_view message = status_message_;
+      if (message.empty() && default_message != default_status_messages.end()) {
+        message = default_message->second;
+      }
+      auto const preamble = header_preamble::local().block();
+      std::string head;
+      head.reserve(128 + preamble.size() + (header_block_ ? header_block_->size() : 0));
+      head.append(request_->protocol())
+          .append("/")
+          .append(request_->http_version())
+          .append(" ")
+          .append(std::to_string(status_))
+          .append(" ")
+          .append(message)
+          .append("\r\n");
+      auto const status_end = head.size();
+      head.append(preamble);
+      auto const headers_begin = head.size();
+      if (header_block_) {
+        head.append(*header_block_);
+      }
+      for (auto const& [header, value] : headers_) {
+        head.append(header).append(": ").append(value).append("\r\n");
+      }
+      if (!coding.empty()) {
+        head.append("Content-Encoding: ").append(coding).append("\r\n");
+      }
+      if (compressed != nullptr) {
+        if (find_header("vary").empty()) {
+          head.append("Vary: ").append(compressed->vary()).append("\r\n");
+        }
+        compressed->advertise(*request_, head);
+      }
+      if (status_ != 304) {
+        head.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+      }
+      if (!body.empty() && !header_block_ && find_header("content-type").empty()) {
+        head.append("Content-Type: text/html\r\n");
+      }
+      if (cache_ != nullptr) {
+        store(head, status_end, headers_begin, head.size(), body);
+      }
+      if (unmodified && status_ == 200) {
+        head.replace(0, status_end, not_modified_line());
+        body = buffer_chain{};
+      }
+      head.append(request_->keep_alive() ? "Connection: Keep-Alive\r\n" : "Connection: close\r\n");
+      head.append("\r\n");
+      output_->push(std::move(head));
+      if (request_->method() != "HEAD") {
+        output_->push(std::move(body));
+      }
+      sent_ = true;
+    }
+  };
+
+  // TODO
+  std::unordered_map<int, std::string const> response::default_status_messages = {
+      {200, "OK"},
+      {206, "Partial Content"},
+      {304, "Not Modified"},
+      {400, "Bad Request"},
+      {403, "Forbidden"},
+      {404, "Not Found"},
+      {405, "Method Not Allowed"},
+      {408, "Request Timeout"},
+      {413, "Content Too Large"},
+      {416, "Range Not Satisfiable"},
+      {431, "Request Header Fields Too Large"},
+      {500, "Internal Server Error"},
+      {503, "Service Unavailable"}};
+
+  // the absolute and lexically normal form of a path without a trailing separator. the file
+  // watcher reports paths in this form, and the static file caches are keyed by it.
+  inline std::filesystem::path normal_path(std::filesystem::path const& path) {
+    auto normal = std::filesystem::absolute(path).lexically_normal();
+    if (!normal.has_filename() && normal.has_relative_path()) {
+      normal = normal.parent_path();
+    }
+    return normal;
+  }
+
+  // reports the paths changed under directory trees with inotify(7). the event loop calls
+  // on_readable() when the descriptor becomes readable.
+  class file_watcher {
+  public:
+    // path is the changed file, or a directory whose whole tree changed when tree is true. an
+    // empty path with tree set means that events were lost and everything may have changed.
+    using listener = std::function<void(std::filesystem::path const& path, bool tree)>;
+
+  private:
+    static constexpr std::uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+                                          IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                          IN_DELETE_SELF | IN_MOVE_SELF;
+
+    int fd_ = -1;
+    std::unordered_map<int, std::filesystem::path> directories_;
+    std::vector<listener> listeners_;
+
+    void notify(std::filesystem::path const& path, bool tree) const {
+      for (auto const& l : listeners_) {
+        l(path, tree);
+      }
+    }
+
+  public:
+    file_watcher() {
+      if ((fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        throw std::system_error{errno, std::generic_category(), "inotify_init1"};
+      }
+    }
+
+    file_watcher(file_watcher const&) = delete;
+    file_watcher& operator=(file_watcher const&) = delete;
+
+    ~file_watcher() {
+      ::close(fd_);
+    }
+
+    int fd() const noexcept {
+      return fd_;
+    }
+
+    void subscribe(listener l) {
+      listeners_.push_back(std::move(l));
+    }
+
+    void watch_tree(std::filesystem::path const& root) {
+      auto const add = [this](std::filesystem::path const& dir) {
+        auto const wd = ::inotify_add_watch(fd_, dir.c_str(), mask | IN_ONLYDIR);
+        if (wd >= 0) {
+          directories_[wd] = normal_path(dir);
+        }
+      };
+      add(root);
+      std::error_code ec;
+      for (std::filesystem::recursive_directory_iterator it{root, ec}, end; !ec && it != end;
+           it.increment(ec)) {
+        if (it->is_directory(ec)) {
+          add(it->path());
+        }
+      }
+    }
+
+    void on_readable() {
+      alignas(::inotify_event) char buffer[4096];
+      while (true) {
+        auto const length = ::read(fd_, buffer, sizeof(buffer));
+        if (length <= 0) {
+          if (length < 0 && errno == EINTR) {
+            continue;
+          }
+          return;
+        }
+        for (auto p = buffer; p < buffer + length;) {
+          auto const* ev = reinterpret_cast<::inotify_event const*>(p);
+          p += sizeof(::inotify_event) + ev->len;
+          if (ev->mask & IN_Q_OVERFLOW) {
+            notify({}, true);
+            continue;
+          }
+          auto const dir = directories_.find(ev->wd);
+          if (dir == directories_.end()) {
+            continue;
+          }
+          if (ev->mask & IN_IGNORED) {
+            directories_.erase(dir);
+            continue;
+          }
+          if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            notify(dir->second, true);
+            continue;
+          }
+          auto const path = normal_path(dir->second / ev->name);
+          if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+              watch_tree(path);
+            }
+            notify(path, true);
+          } else {
+            notify(path, false);
+          }
+        }
+      }
+    }
+  };
+
+  // approximate access frequencies in a count-min sketch of saturating 4-bit counters. all
+  // counters are halved after a sample of increments, so old popularity fades. this is the
+  // admission filter of TinyLFU.
+  class frequency_sketch {
+    static constexpr int rows = 4;
+    std::vector<std::uint8_t> counters_;
+    std::size_t mask_;
+    std::size_t additions_ = 0;
+    std::size_t sample_size_;
+
+    std::size_t index(std::size_t hash, int row) const noexcept {
+      std::uint64_t h = (hash + row) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 32;
+      return row * (mask_ + 1) + (h & mask_);
+    }
+
+  public:
+    explicit frequency_sketch(std::size_t width) {
+      std::size_t w = 64;
+      while (w < width) {
+        w <<= 1;
+      }
+      mask_ = w - 1;
+      sample_size_ = w * 10;
+      counters_.assign(w * rows, 0);
+    }
+
+    void increment(std::size_t hash) noexcept {
+      for (auto row = 0; row < rows; ++row) {
+        auto& counter = counters_[index(hash, row)];
+        if (counter < 15) {
+          ++counter;
+        }
+      }
+      if (++additions_ == sample_size_) {
+        for (auto& counter : counters_) {
+          counter >>= 1;
+        }
+        additions_ /= 2;
+      }
+    }
+
+    unsigned estimate(std::size_t hash) const noexcept {
+      unsigned result = 15;
+      for (auto row = 0; row < rows; ++row) {
+        result = std::min<unsigned>(result, counters_[index(hash, row)]);
+      }
+      return result;
+    }
+  };
+
+  struct asset_cache_limits {
+    std::size_t capacity = 32 << 20;         // bytes of cached keys, headers and contents
+    std::size_t max_entry_size = 256 << 10;  // larger files are always sent with sendfile(2)
+  };
+
+  // small static files kept in memory with their serialized headers. both are immutable and
+  // shared, so a hit queues references and costs only the write. entries are evicted in LRU
+  // order, but a new entry which needs evictions is admitted only when the sketch says it is
+  // accessed more often than every entry it would replace. shared by all event loops.
+  class asset_cache {
+  public:
+    struct entry {
+      std::shared_ptr<std::string const> headers;
+      std::shared_ptr<std::string const> not_modified;  // the header lines of a 304
+      std::shared_ptr<std::string const> content;
+    };
+
+  private:
+    struct node {
+      std::string key;
+      entry value;
+      std::size_t charge;
+    };
+
+    // invalidations of single paths remembered to refuse the contents read before them
+    static constexpr std::size_t remembered_invalidations = 1024;
+
+    mutable std::mutex mutex_;
+    asset_cache_limits limits_;
+    std::list<node> lru_;  // the most recently used first
+    std::unordered_map<std::string_view, std::list<node>::iterator> index_;
+    std::size_t size_ = 0;
+    frequency_sketch sketch_;
+    std::uint64_t generation_ = 0;  // counts the invalidations
+    // the generation of the last invalidation of a path. those of trees and forgotten paths are
+    // represented by floor_, which refuses every older insert.
+    std::unordered_map<std::string, std::uint64_t> invalidated_;
+    std::uint64_t floor_ = 0;
+
+    void erase(std::list<node>::iterator it) {
+      size_ -= it->charge;
+      index_.erase(it->key);
+      lru_.erase(it);
+    }
+
+    // returns the first of the least recently used entries which make room for charge bytes, or
+    // nullopt when one of them is used at least as often as key, which is then not admitted.
+    std::optional<std::list<node>::iterator> victims(std::string const& key, std::size_t charge) {
+      if (charge > limits_.capacity) {
+        return std::nullopt;
+      }
+      auto const frequency = sketch_.estimate(std::hash<std::string>{}(key));
+      auto victim = lru_.end();
+      for (auto freed = limits_.capacity - size_; freed < charge;) {
+        --victim;
+        if (sketch_.estimate(std::hash<std::string>{}(victim->key)) >= frequency) {
+          return std::nullopt;
+        }
+        freed += victim->charge;
+      }
+      return victim;
+    }
+
+  public:
+    explicit asset_cache(asset_cache_limits limits)
+        : limits_{limits}, sketch_{std::max<std::size_t>(limits.capacity / 4096, 1024)} {
+    }
+
+    // returns false for files which are never cached.
+    bool cacheable(std::size_t size) const noexcept {
+      return size <= limits_.max_entry_size && size < limits_.capacity;
+    }
+
+    // looks an entry up and records the access for admission.
+    std::optional<entry> find(std::string const& key) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      sketch_.increment(std::hash<std::string>{}(key));
+      auto const it = index_.find(key);
+      if (it == index_.end()) {
+        return std::nullopt;
+      }
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->value;
+    }
+
+    // whether an entry of charge bytes would be admitted now, so that a file which would be
+    // refused is not read into memory.
+    bool admits(std::string const& key, std::size_t charge) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return victims(key, charge).has_value();
+    }
+
+    // the generation to insert the contents of a file read from now on with.
+    std::uint64_t generation() const {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return generation_;
+    }
+
+    // returns false when the entry is not admitted. an entry read before the generation of the
+    // last invalidation of its path is refused, since an event loop may insert it after another
+    // one has handled the invalidation.
+    bool insert(std::string key, entry value, std::uint64_t generation) {
+      auto const charge = key.size() + value.headers->size() + value.not_modified->size() +
+                          value.content->size();
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (generation < floor_) {
+        return false;
+      }
+      if (auto const it = invalidated_.find(key);
+          it != invalidated_.end() && generation < it->second) {
+        return false;
+      }
+      if (auto const it = index_.find(key); it != index_.end()) {
+        erase(it->second);
+      }
+      auto const victim = victims(key, charge);
+      if (!victim) {
+        return false;
+      }
+      for (auto it = *victim; it != lru_.end();) {
+        erase(it++);
+      }
+      lru_.push_front(node{std::move(key), std::move(value), charge});
+      index_.emplace(lru_.front().key, lru_.begin());
+      size_ += charge;
+      return true;
+    }
+
+    void invalidate(std::filesystem::path const& path, bool tree) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      ++generation_;
+      if (!tree) {
+        if (invalidated_.size() >= remembered_invalidations) {
+          invalidated_.clear();
+          floor_ = generation_;
+        }
+        invalidated_.insert_or_assign(path.native(), generation_);
+        if (auto const it = index_.find(path.native()); it != index_.end()) {
+          erase(it->second);
+        }
+        return;
+      }
+      invalidated_.clear();
+      floor_ = generation_;
+      auto const& prefix = path.native();
+      for (auto it = lru_.begin(); it != lru_.end();) {
+        auto const under = prefix.empty() || (it->key.compare(0, prefix.size(), prefix) == 0 &&
+                                              (it->key.size() == prefix.size() ||
+                                               it->key[prefix.size()] == '/'));
+        if (under) {
+          erase(it++);
+        } else {
+          ++it;
+        }
+      }
+    }
+  };
+
+  struct file_cache_limits {
+    std::size_t capacity = 1024;  // open descriptors
+    std::size_t missing = 256;    // remembered missing sidecars
+    std::chrono::milliseconds ttl{10000};
+  };
+
+  // open descriptors of static files and their fstat(2) results, keyed by the normalized path, so
+  // that hot files skip open, fstat and close on each request. entries are immutable and shared
+  // by all event loops; a descriptor is closed when the last response using it is sent. entries
+  // expire after a TTL in case a change is not reported by inotify.
+  //
+  // missing optional files such as precompressed sidecars are remembered apart from the
+  // descriptors, so probing for them costs no syscall either, and requests for missing paths
+  // cannot push hot descriptors out.
+  class file_cache {
+  public:
+    struct entry {
+      std::shared_ptr<file const> source;
+      struct ::stat st;
+    };
+
+    struct counters {
+      std::uint64_t hits;
+      std::uint64_t misses;
+      std::uint64_t evictions;
+      std::uint64_t invalidations;
+    };
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct node {
+      std::string key;
+      entry value;
+      clock::time_point expires;
+    };
+
+    mutable std::mutex mutex_;
+    file_cache_limits limits_;
+    std::list<node> lru_;  // the most recently used first
+    std::unordered_map<std::string_view, std::list<node>::iterator> index_;
+    std::unordered_map<std::string, clock::time_point> missing_;  // and when they expire
+    std::atomic<std::uint64_t> hits_{0};
+    std::atomic<std::uint64_t> misses_{0};
+    std::atomic<std::uint64_t> evictions_{0};
+    std::atomic<std::uint64_t> invalidations_{0};
+
+    void erase(std::list<node>::iterator it) {
+      index_.erase(it->key);
+      lru_.erase(it);
+    }
+
+  public:
+    explicit file_cache(file_cache_limits limits) : limits_{limits} {
+    }
+
+    // returns an open regular file, or nullopt when the path does not name one. a missing
+    // optional file is remembered as missing until it is created or the TTL passes.
+    std::optional<entry> open(std::filesystem::path const& path, bool optional = false) {
+      auto const now = clock::now();
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (auto const it = index_.find(path.native()); it != index_.end()) {
+          if (it->second->expires > now) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->value;
+          }
+          erase(it->second);
+        }
+        if (auto const it = missing_.find(path.native()); it != missing_.end()) {
+          if (it->second > now) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+          }
+          missing_.erase(it);
+        }
+      }
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      entry e{};
+      auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        if (optional && (errno == ENOENT || errno == ENOTDIR) && limits_.missing > 0) {
+          std::lock_guard<std::mutex> lock{mutex_};
+          if (missing_.size() >= limits_.missing) {
+            missing_.erase(missing_.begin());
+          }
+          missing_.insert_or_assign(path.native(), now + limits_.ttl);
+        }
+        return std::nullopt;
+      }
+      e.source = std::make_shared<file const>(fd);
+      if (::fstat(fd, &e.st) != 0 || !S_ISREG(e.st.st_mode)) {
+        return std::nullopt;
+      }
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (auto const it = index_.find(path.native()); it != index_.end()) {
+        erase(it->second);
+      }
+      while (!lru_.empty() && lru_.size() >= limits_.capacity) {
+        erase(std::prev(lru_.end()));
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (limits_.capacity > 0) {
+        lru_.push_front(node{path.native(), e, now + limits_.ttl});
+        index_.emplace(lru_.front().key, lru_.begin());
+      }
+      return e;
+    }
+
+    void invalidate(std::filesystem::path const& path, bool tree) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (!tree) {
+        missing_.erase(path.native());
+        if (auto const it = index_.find(path.native()); it != index_.end()) {
+          erase(it->second);
+          invalidations_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+      }
+      auto const& prefix = path.native();
+      auto const under = [&prefix](std::string const& key) {
+        return prefix.empty() ||
+               (key.compare(0, prefix.size(), prefix) == 0 &&
+                (key.size() == prefix.size() || key[prefix.size()] == '/'));
+      };
+      for (auto it = missing_.begin(); it != missing_.end();) {
+        it = under(it->first) ? missing_.erase(it) : std::next(it);
+      }
+      for (auto it = lru_.begin(); it != lru_.end();) {
+        if (under(it->key)) {
+          erase(it++);
+          invalidations_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    counters stats() const noexcept {
+      return {hits_.load(std::memory_order_relaxed), misses_.load(std::memory_order_relaxed),
+              evictions_.load(std::memory_order_relaxed),
+              invalidations_.load(std::memory_order_relaxed)};
+    }
+  };
+
+  struct byte_range {
+    std::uint64_t offset;
+    std::uint64_t length;
+  };
+
+  // parses a Range header of byte ranges, each "first-last", "first-" or "-suffix". returns
+  // nullopt for an invalid header or an empty list, which are ignored, and an empty vector when no
+  // range is satisfiable. overlapping and adjacent ranges are coalesced, so that a list of them
+  // cannot make the body larger than the file; the ranges are then in ascending order.
+  inline std::optional<std::vector<byte_range>> parse_ranges(std::string_view value,
+                                                             std::uint64_t size) {
+    constexpr std::string_view unit = "bytes=";
+    if (value.substr(0, unit.size()) != unit) {
+      return std::nullopt;
+    }
+    value.remove_prefix(unit.size());
+    if (trim(value).empty()) {
+      return std::nullopt;
+    }
+    auto const parse = [](std::string_view str, std::uint64_t& out) {
+      auto const result = std::from_chars(str.data(), str.data() + str.size(), out);
+      return !str.empty() && result.ec == std::errc{} && result.ptr == str.data() + str.size();
+    };
+    std::vector<byte_range> ranges;
+    while (!value.empty()) {
+      auto const comma = value.find(',');
+      auto const spec = trim(value.substr(0, comma));
+      value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+      auto const dash = spec.find('-');
+      if (dash == std::string_view::npos) {
+        return std::nullopt;
+      }
+      std::uint64_t first = 0;
+      std::uint64_t last = size - 1;
+      if (dash == 0) {
+        std::uint64_t suffix = 0;
+        if (!parse(spec.substr(1), suffix)) {
+          return std::nullopt;
+        }
+        if (suffix == 0 || size == 0) {
+          continue;
+        }
+        first = suffix < size ? size - suffix : 0;
+      } else {
+        if (!parse(spec.substr(0, dash), first) ||
+            (dash + 1 < spec.size() && !parse(spec.substr(dash + 1), last))) {
+          return std::nullopt;
+        }
+        if (dash + 1 < spec.size() && first > last) {
+          return std::nullopt;
+        }
+        if (first >= size) {
+          continue;
+        }
+        last = std::min(last, size - 1);
+      }
+      ranges.push_back({first, last - first + 1});
+    }
+    if (ranges.size() > 1) {
+      std::sort(ranges.begin(), ranges.end(), [](byte_range const& lhs, byte_range const& rhs) {
+        return lhs.offset < rhs.offset;
+      });
+      auto merged = ranges.begin();
+      for (auto it = std::next(ranges.begin()); it != ranges.end(); ++it) {
+        if (it->offset <= merged->offset + merged->length) {
+          merged->length = std::max(merged->length, it->offset + it->length - merged->offset);
+        } else {
+          *++merged = *it;
+        }
+      }
+      ranges.erase(std::next(merged), ranges.end());
+    }
+    return ranges;
+  }
+
+  // evaluates If-Range against the validators of a representation. an entity tag must match
+  // strongly, and a date must equal Last-Modified.
+  inline bool if_range_matches(request const& req,
+                               std::string_view etag,
+                               std::string_view last_modified) {
+    auto const value = trim(req.header("if-range"));
+    if (value.empty()) {
+      return true;
+    }
+    if (value.front() == '"') {
+      return etag.substr(0, 2) != "W/" && value == etag;
+    }
+    std::time_t since{};
+    std::time_t modified{};
+    return parse_http_date(value, since) && parse_http_date(last_modified, modified) &&
+           since == modified;
+  }
+
+  // content codings of precompressed sidecar files in the order of preference.
+  constexpr std::pair<std::string_view, std::string_view> precompressed_sidecars[] = {
+      {"br", ".br"},
+      {"zstd", ".zst"},
+      {"gzip", ".gz"}};
+
+  struct static_options {
+    bool precompressed = false;  // serve file.br, file.zst or file.gz when the client accepts it
+    std::size_t max_ranges = 16;  // a Range header with more ranges is ignored
+  };
+
+  // serves the files under a root directory for the request paths under a prefix. response
+  // headers are built from fstat(2) of the opened file and the content is sent with sendfile(2),
+  // so file bytes never enter user space. with an asset cache, small files are served from
+  // memory instead. with precompressed sidecars, a compressed file which is not older than the
+  // original is sent with its Content-Encoding and the compression costs nothing per request.
+  class static_files {
+    std::string prefix_;
+    std::filesystem::path root_;
+    static_options options_;
+    asset_cache* cache_ = nullptr;
+    file_cache* files_ = nullptr;
+
+    static std::string_view mime_type(std::filesystem::path const& path) {
+      static std::unordered_map<std::string, std::string_view> const types = {
+          {".html", "text/html; charset=utf-8"},
+          {".htm", "text/html; charset=utf-8"},
+          {".css", "text/css; charset=utf-8"},
+          {".js", "text/javascript; charset=utf-8"},
+          {".mjs", "text/javascript; charset=utf-8"},
+          {".json", "application/json"},
+          {".txt", "text/plain; charset=utf-8"},
+          {".md", "text/markdown; charset=utf-8"},
+          {".xml", "application/xml"},
+          {".svg", "image/svg+xml"},
+          {".png", "image/png"},
+          {".jpg", "image/jpeg"},
+          {".jpeg", "image/jpeg"},
+          {".gif", "image/gif"},
+          {".webp", "image/webp"},
+          {".avif", "image/avif"},
+          {".ico", "image/x-icon"},
+          {".wasm", "application/wasm"},
+          {".pdf", "application/pdf"},
+          {".woff", "font/woff"},
+          {".woff2", "font/woff2"},
+          {".mp4", "video/mp4"},
+          {".webm", "video/webm"},
+          {".mp3", "audio/mpeg"},
+          {".zip", "application/zip"},
+          {".gz", "application/gzip"},
+          {".tar", "application/x-tar"}};
+      auto extension = path.extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      auto const it = types.find(extension);
+      return it != types.end() ? it->second : "application/octet-stream";
+    }
+
+    // decodes percent-encoding and returns a path relative to the root, or nullopt when the path
+    // could leave the root or names a dotfile such as .git or .env.
+    static std::optional<std::string> relative_path(std::string_view path) {
+      std::string decoded;
+      decoded.reserve(path.size());
+      for (std::size_t i = 0; i < path.size(); ++i) {
+        if (path[i] == '%') {
+          unsigned value = 0;
+          if (i + 2 >= path.size() ||
+              std::from_chars(path.data() + i + 1, path.data() + i + 3, value, 16).ptr !=
+                  path.data() + i + 3) {
+            return std::nullopt;
+          }
+          decoded.push_back(static_cast<char>(value));
+          i += 2;
+        } else {
+          decoded.push_back(path[i]);
+        }
+      }
+      if (decoded.find('\0') != std::string::npos || decoded.find('\\') != std::string::npos) {
+        return std::nullopt;
+      }
+      std::string_view rest{decoded};
+      while (!rest.empty()) {
+        auto const slash = rest.find('/');
+        if (rest.front() == '.') {
+          return std::nullopt;
+        }
+        rest.remove_prefix(slash == std::string_view::npos ? rest.size() : slash + 1);
+      }
+      decoded.erase(0, decoded.find_first_not_of('/'));
+      if (decoded.empty() || decoded.back() == '/') {
+        decoded.append("index.html");
+      }
+      return decoded;
+    }
+
+    // the header lines of a 200 and of a 304, which has only the validators and Vary. the ETag is
+    // built from the inode, the size and the modification time. it is strong, so that If-Range
+    // can use it, and weakened by the response when the body is compressed on the fly.
+    std::pair<std::string, std::string> file_headers(std::filesystem::path const& path,
+                                                     struct ::stat const& st,
+                                                     std::string_view coding) const {
+      std::string validators;
+      char tag[80];
+      auto const length = std::snprintf(
+          tag, sizeof(tag), "\"%llx-%llx-%llx.%lx\"", static_cast<unsigned long long>(st.st_ino),
+          static_cast<unsigned long long>(st.st_size),
+          static_cast<unsigned long long>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec);
+      validators.append("ETag: ").append(tag, static_cast<std::size_t>(length)).append("\r\n");
+      char date[http_date_length + 1];
+      if (format_http_date(st.st_mtime, date)) {
+        validators.append("Last-Modified: ").append(date).append("\r\n");
+      }
+      if (options_.precompressed) {
+        validators.append("Vary: Accept-Encoding\r\n");
+      }
+      std::string block;
+      block.append("Content-Type: ").append(mime_type(path)).append("\r\n");
+      if (!coding.empty()) {
+        block.append("Content-Encoding: ").append(coding).append("\r\n");
+      }
+      block.append("Accept-Ranges: bytes\r\n").append(validators);
+      return {std::move(block), std::move(validators)};
+    }
+
+    // answers a conditional request with the 304 of a representation.
+    static bool serve_not_modified(request const& req,
+                                   std::shared_ptr<std::string const> const& validators,
+                                   response& res) {
+      if (!not_modified(req, block_header(*validators, "etag"),
+                        block_header(*validators, "last-modified"))) {
+        return false;
+      }
+      res.status(304).header_block(validators).send(buffer_chain{});
+      return true;
+    }
+
+    // reads a whole file into memory, or returns nullptr when it changed size while reading.
+    static std::shared_ptr<std::string const> read_content(int fd, std::size_t size) {
+      auto content = std::make_shared<std::string>(size, '\0');
+      std::size_t done = 0;
+      while (done < size) {
+        auto const n = ::pread(fd, content->data() + done, size - done, done);
+        if (n <= 0) {
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          return nullptr;
+        }
+        done += static_cast<std::size_t>(n);
+      }
+      return content;
+    }
+
+  public:
+    static_files(std::string prefix, std::filesystem::path root, static_options options)
+        : prefix_{std::move(prefix)},
+          root_{normal_path(root.empty() ? "." : root)},
+          options_{options} {
+    }
+
+    std::filesystem::path const& root() const noexcept {
+      return root_;
+    }
+
+    void cache(asset_cache* cache) noexcept {
+      cache_ = cache;
+    }
+
+    void cache(file_cache* files) noexcept {
+      files_ = files;
+    }
+
+    std::optional<file_cache::entry> open(std::filesystem::path const& path,
+                                          bool optional = false) const {
+      if (files_ != nullptr) {
+        return files_->open(path, optional);
+      }
+      auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return std::nullopt;
+      }
+      file_cache::entry e{std::make_shared<file const>(fd), {}};
+      if (::fstat(fd, &e.st) != 0 || !S_ISREG(e.st.st_mode)) {
+        return std::nullopt;
+      }
+      return e;
+    }
+
+    bool serve_cached(request const& req, std::string const& key, response& res) const {
+      auto const hit = cache_->find(key);
+      if (!hit) {
+        return false;
+      }
+      if (serve_not_modified(req, hit->not_modified, res)) {
+        return true;
+      }
+      buffer_chain body;
+      body.append_shared(hit->content);
+      res.header_block(hit->headers).send(std::move(body));
+      return true;
+    }
+
+    // sends an opened representation of path. key is the path of the representation, which is
+    // the path of a sidecar when coding is not empty. generation is the one of the asset cache
+    // from before the file was opened.
+    void serve_file(request const& req,
+                    std::filesystem::path const& path,
+                    std::string const& key,
+                    file_cache::entry& opened,
+                    std::string_view coding,
+                    std::uint64_t generation,
+                    response& res) const {
+      auto const& st = opened.st;
+      auto const size = static_cast<std::uint64_t>(st.st_size);
+      auto [block, validators] = file_headers(path, st, coding);
+      auto headers = std::make_shared<std::string const>(std::move(block));
+      auto not_modified = std::make_shared<std::string const>(std::move(validators));
+      auto const requested = req.header("range");
+      if (cache_ != nullptr && requested.empty() && cache_->cacheable(size) &&
+          cache_->admits(key, key.size() + headers->size() + not_modified->size() + size)) {
+        if (auto content = read_content(opened.source->fd(), size)) {
+          cache_->insert(key, asset_cache::entry{headers, not_modified, content}, generation);
+          if (serve_not_modified(req, not_modified, res)) {
+            return;
+          }
+          buffer_chain body;
+          body.append_shared(std::move(content));
+          res.header_block(std::move(headers)).send(std::move(body));
+          return;
+        }
+      }
+      if (serve_not_modified(req, not_modified, res)) {
+        return;
+      }
+      std::optional<std::vector<byte_range>> ranges;
+      if (!requested.empty() && if_range_matches(req, block_header(*not_modified, "etag"),
+                                                 block_header(*not_modified, "last-modified"))) {
+        ranges = parse_ranges(requested, size);
+      }
+      if (ranges && ranges->empty()) {
+        res.status(416).set_header("Content-Range", "bytes */" + std::to_string(size));
+        res.send(buffer_chain{});
+        return;
+      }
+      if (!ranges || ranges->size() > options_.max_ranges) {
+        buffer_chain body;
+        body.append_file({std::move(opened.source), 0, static_cast<std::size_t>(size)});
+        res.header_block(std::move(headers)).send(std::move(body));
+        return;
+      }
+      auto const content_range = [size](byte_range const& r) {
+        return "bytes " + std::to_string(r.offset) + "-" + std::to_string(r.offset + r.length - 1) +
+               "/" + std::to_string(size);
+      };
+      auto const range_of = [&opened](byte_range const& r) {
+        return file_range{opened.source, static_cast<::off_t>(r.offset),
+                          static_cast<std::size_t>(r.length)};
+      };
+      res.status(206);
+      buffer_chain body;
+      if (ranges->size() == 1) {
+        body.append_file(range_of(ranges->front()));
+        res.header_block(std::move(headers))
+            .set_header("Content-Range", content_range(ranges->front()));
+        res.send(std::move(body));
+        return;
+      }
+      // multipart/byteranges: the part headers are small strings between the file ranges, so the
+      // whole body is written by sendmsg(2) and sendfile(2) without copying the file.
+      char boundary[24];
+      auto const end = std::to_chars(boundary, boundary + sizeof(boundary),
+                                     hash64(key, static_cast<std::uint64_t>(st.st_mtim.tv_nsec)),
+                                     16)
+                           .ptr;
+      std::string_view const separator{boundary, static_cast<std::size_t>(end - boundary)};
+      auto const type = block_header(*headers, "content-type");
+      for (auto const& r : *ranges) {
+        std::string part;
+        part.append("\r\n--")
+            .append(separator)
+            .append("\r\nContent-Type: ")
+            .append(type)
+            .append("\r\nContent-Range: ")
+            .append(content_range(r))
+            .append("\r\n\r\n");
+        body.append(std::move(part));
+        body.append_file(range_of(r));
+      }
+      body.append(std::string{"\r\n--"}.append(separator).append("--\r\n"));
+      // the block without its Content-Type, which is the first line
+      auto multipart = std::string{"Content-Type: multipart/byteranges; boundary="}
+                           .append(separator)
+                           .append("\r\n")
+                           .append(headers->substr(headers->find("\r\n") + 2));
+      res.header_block(std::make_shared<std::string const>(std::move(multipart)))
+          .send(std::move(body));
+    }
+
+    // returns false when the request is not for this mount or no regular file matches it.
+    bool serve(request const& req, response& res) const {
+      // the prefix is a whole number of segments: /static matches /static/a but not /statica
+      auto const url = req.path();
+      if (url.compare(0, prefix_.size(), prefix_) != 0 ||
+          (url.size() > prefix_.size() && !prefix_.empty() && prefix_.back() != '/' &&
+           url[prefix_.size()] != '/')) {
+        return false;
+      }
+      auto const relative = relative_path(url.substr(prefix_.size()));
+      if (!relative) {
+        return false;
+      }
+      auto const path = (root_ / *relative).lexically_normal();
+      auto const requested = req.header("range");
+      // taken before the files are opened, so a change reported meanwhile is not cached
+      auto const generation = cache_ != nullptr ? cache_->generation() : 0;
+      std::optional<file_cache::entry> original;
+      if (options_.precompressed && requested.empty()) {
+        auto const accept = req.header("accept-encoding");
+        for (auto const& [coding, extension] : precompressed_sidecars) {
+          if (accept.empty() || accept_quality(accept, coding) <= 0) {
+            continue;
+          }
+          auto const sidecar = path.native() + std::string{extension};
+          if (cache_ != nullptr && serve_cached(req, sidecar, res)) {
+            return true;
+          }
+          auto opened = open(sidecar, true);
+          if (!opened) {
+            continue;
+          }
+          if (!original && !(original = open(path))) {
+            return false;
+          }
+          if (opened->st.st_mtime < original->st.st_mtime) {
+            continue;
+          }
+          serve_file(req, path, sidecar, *opened, coding, generation, res);
+          return true;
+        }
+      }
+      if (cache_ != nullptr && requested.empty() && serve_cached(req, path.native(), res)) {
+        return true;
+      }
+      if (!original && !(original = open(path))) {
+        return false;
+      }
+      serve_file(req, path, path.native(), *original, "", generation, res);
+      return true;
+    }
+  };
+
+  // bounds of the response bytes buffered in memory for clients which do not read them. reading
+  // from a connection pauses above a high-water mark and resumes below half of it, so a slow
+  // reader cannot make the server buffer without limit.
+  struct output_limits {
+    std::size_t connection_high_water = 1 << 20;
+    std::size_t global_high_water = 64 << 20;
+  };
+
+  // budgets of the memory charged to connections. a connection over one is answered with an error
+  // status and closed.
+  struct memory_limits {
+    // the arena of a request: its line and headers, 431 when they do not fit, and what the handler
+    // allocates there, 503
+    std::size_t request = 64 << 10;
+    std::size_t request_body = 1 << 20;  // a larger Content-Length is answered with 413
+    std::size_t connection = 16 << 20;   // request and queued output; later requests get 503
+    // request and queued output of all connections; requests are shed with 503 beyond it
+    std::size_t global = 1 << 30;
+  };
+
+  // how long a connection waits for its client before it is closed. the event loops count them in
+  // ticks of their one second timer, so a timeout fires up to a second late but never early.
+  struct timeouts {
+    // the request line and headers from their first byte, or from the accept for the first
+    // request. answered with 408 when a part has arrived.
+    std::chrono::seconds header{10};
+    std::chrono::seconds body{30};        // between two reads of a request body, 408
+    std::chrono::seconds write{30};       // between two writes while output is queued
+    std::chrono::seconds keep_alive{60};  // between a response and the next request
+  };
+
+  class memory_budget_exceeded : public std::bad_alloc {
+  public:
+    char const* what() const noexcept override {
+      return "memory budget exceeded";
+    }
+  };
+
+  // frees a pooled buffer from the heap. the buffers carved out of a region go with the region.
+  struct buffer_deleter {
+    bool heap = true;
+
+    void operator()(std::byte* data) const noexcept {
+      if (heap) {
+        delete[] data;
+      }
+    }
+  };
+
+  // buffers of 4, 16 and 64 KiB recycled by an event loop. a released buffer is handed out again
+  // as it is, without clearing, and buffers beyond the budget of a tier go back to the heap.
+  //
+  // with huge pages, a tier is carved out of 2 MiB regions instead, so that the buffers of many
+  // connections share a few dTLB entries. a region is mapped with MAP_HUGETLB from the pages
+  // reserved in /proc/sys/vm/nr_hugepages, or else aligned to 2 MiB and advised with
+  // MADV_HUGEPAGE for transparent huge pages. a region whose buffers are all free is unmapped when
+  // its tier has another region's worth of free buffers, so a burst does not keep its memory.
+  class buffer_pool {
+  public:
+    static constexpr std::size_t tiers = 3;
+    static constexpr std::size_t region_size = 2 << 20;
+
+    using memory = std::unique_ptr<std::byte[], buffer_deleter>;
+
+    struct buffer {
+      memory data;
+      std::size_t size = 0;
+      std::size_t tier = 0;
+    };
+
+    static constexpr std::size_t size_of(std::size_t tier) noexcept {
+      return std::size_t{4096} << (2 * tier);
+    }
+
+  private:
+    std::array<std::vector<memory>, tiers> free_;
+    std::size_t budget_;  // bytes kept per tier
+    bool huge_pages_;
+    // the free buffers of each region, by its address. regions are aligned to their size, so the
+    // region of a buffer is found by masking its address.
+    std::unordered_map<std::uintptr_t, std::size_t> regions_;
+    std::size_t hugetlb_regions_ = 0;
+
+    static constexpr std::size_t buffers_per_region(std::size_t tier) noexcept {
+      return region_size / size_of(tier);
+    }
+
+    static std::uintptr_t region_of(std::byte const* data) noexcept {
+      return reinterpret_cast<std::uintptr_t>(data) & ~(region_size - 1);
+    }
+
+    // unmaps a region whose buffers are all in the free list of its tier.
+    void unmap(std::uintptr_t region, std::size_t tier) {
+      auto& free = free_[tier];
+      free.erase(std::remove_if(free.begin(), free.end(),
+                                [region](memory const& m) { return region_of(m.get()) == region; }),
+                 free.end());
+      regions_.erase(region);
+      ::munmap(reinterpret_cast<void*>(region), region_size);
+    }
+
+    void* map_region() {
+      auto const flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      auto const protection = PROT_READ | PROT_WRITE;
+      auto* region = ::mmap(nullptr, region_size, protection, flags | MAP_HUGETLB, -1, 0);
+      if (region != MAP_FAILED) {
+        ++hugetlb_regions_;
+        return region;
+      }
+      // a transparent huge page needs an aligned 2 MiB, so the excess of a larger map is cut off
+      auto* const mapped = ::mmap(nullptr, region_size * 2, protection, flags, -1, 0);
+      if (mapped == MAP_FAILED) {
+        throw std::system_error{errno, std::generic_category(), "mmap"};
+      }
+      auto const address = reinterpret_cast<std::uintptr_t>(mapped);
+      auto const aligned = (address + region_size - 1) & ~(region_size - 1);
+      if (aligned > address) {
+        ::munmap(mapped, aligned - address);
+      }
+      ::munmap(reinterpret_cast<void*>(aligned + region_size), address + region_size - aligned);
+      region = reinterpret_cast<void*>(aligned);
+      ::madvise(region, region_size, MADV_HUGEPAGE);
+      return region;
+    }
+
+    void carve(std::size_t tier) {
+      auto& free = free_[tier];
+      free.reserve(free.size() + buffers_per_region(tier));
+      auto* const region = static_cast<std::byte*>(map_region());
+      try {
+        regions_.emplace(reinterpret_cast<std::uintptr_t>(region), buffers_per_region(tier));
+      } catch (...) {
+        ::munmap(region, region_size);
+        throw;
+      }
+      for (auto offset = region_size; offset > 0; offset -= size_of(tier)) {
+        free.emplace_back(region + offset - size_of(tier), buffer_deleter{false});
+      }
+    }
+
+  public:
+    explicit buffer_pool(bool huge_pages = false, std::size_t budget = 1 << 20) noexcept
+        : budget_{budget}, huge_pages_{huge_pages} {
+    }
+
+    buffer_pool(buffer_pool const&) = delete;
+    buffer_pool& operator=(buffer_pool const&) = delete;
+
+    ~buffer_pool() {
+      for (auto& free : free_) {
+        free.clear();
+      }
+      for (auto const& [region, free] : regions_) {
+        ::munmap(reinterpret_cast<void*>(region), region_size);
+      }
+    }
+
+    // the number of regions backed by reserved huge pages rather than transparent ones.
+    std::size_t hugetlb_regions() const noexcept {
+      return hugetlb_regions_;
+    }
+
+    buffer acquire(std::size_t tier) {
+      auto& free = free_[tier];
+      if (free.empty()) {
+        if (!huge_pages_) {
+          return {memory{new std::byte[size_of(tier)]}, size_of(tier), tier};
+        }
+        carve(tier);
+      }
+      auto data = std::move(free.back());
+      free.pop_back();
+      if (!data.get_deleter().heap) {
+        --regions_[region_of(data.get())];
+      }
+      return {std::move(data), size_of(tier), tier};
+    }
+
+    void release(buffer buffer) {
+      auto& free = free_[buffer.tier];
+      if (!buffer.data) {
+        return;
+      }
+      if (buffer.data.get_deleter().heap) {
+        if ((free.size() + 1) * buffer.size <= budget_) {
+          free.push_back(std::move(buffer.data));
+        }
+        return;
+      }
+      auto const region = region_of(buffer.data.get());
+      free.push_back(std::move(buffer.data));
+      auto const per_region = buffers_per_region(buffer.tier);
+      if (++regions_[region] == per_region && free.size() >= 2 * per_region) {
+        unmap(region, buffer.tier);
+      }
+    }
+  };
+
+  // hands out objects from blocks of Count slots and reuses the slots of destroyed ones, so that
+  // objects are not allocated one by one. every object has to be destroyed before the slab.
+  template <typename T, std::size_t Count = 64>
+  class slab {
+    struct slot {
+      alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<slot[]>> blocks_;
+    std::vector<slot*> free_;
+
+  public:
+    slab() = default;
+    slab(slab const&) = delete;
+    slab& operator=(slab const&) = delete;
+
+    template <typename... Args>
+    T* make(Args&&... args) {
+      if (free_.empty()) {
+        blocks_.emplace_back(new slot[Count]);
+        free_.reserve(blocks_.size() * Count);
+        for (auto i = Count; i > 0; --i) {
+          free_.push_back(&blocks_.back()[i - 1]);
+        }
+      }
+      auto* const object = new (free_.back()->storage) T(std::forward<Args>(args)...);
+      free_.pop_back();
+      return object;
+    }
+
+    void destroy(T* object) noexcept {
+      object->~T();
+      free_.push_back(reinterpret_cast<slot*>(object));
+    }
+  };
+
+  // takes the memory of a request beyond its first block from the heap, charges it to a total of
+  // all connections, and throws memory_budget_exceeded when the request would exceed its limit.
+  class budget_resource : public std::pmr::memory_resource {
+    std::size_t charged_;
+    std::size_t limit_;
+    std::atomic<std::size_t>* total_;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+      if (bytes > limit_ - charged_) {
+        throw memory_budget_exceeded{};
+      }
+      auto* const p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+      charged_ += bytes;
+      total_->fetch_add(bytes, std::memory_order_relaxed);
+      return p;
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+      std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+      charged_ -= bytes;
+      total_->fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+      return this == &other;
+    }
+
+  public:
+    // first is the size of the block the request starts with, which counts to the limit.
+    budget_resource(std::size_t first, std::size_t limit, std::atomic<std::size_t>& total) noexcept
+        : charged_{first}, limit_{std::max(limit, first)}, total_{&total} {
+    }
+
+    std::size_t charged() const noexcept {
+      return charged_;
+    }
+  };
+
+  // the memory of a request: the request line, the headers and what the handler allocates in the
+  // block and then from the heap up to the request budget, and the body from the heap up to a
+  // budget of its own.
+  struct request_arena {
+    budget_resource budget;
+    budget_resource body;
+    std::pmr::monotonic_buffer_resource resource;
+
+    request_arena(std::byte* block,
+                  std::size_t size,
+                  memory_limits const& limits,
+                  std::atomic<std::size_t>& total) noexcept
+        // the body takes one byte more for the terminating null
+        : budget{size, limits.request, total},
+          body{0, limits.request_body + 1, total},
+          resource{block, size, &budget} {
+    }
+
+    std::size_t charged() const noexcept {
+      return budget.charged() + body.charged();
+    }
+  };
+
+  // a hierarchical timing wheel of four levels of 64 slots, turned one tick at a time. an entry is
+  // linked into the slot of its expiry on the lowest level which spans it, and moves down a level
+  // when the wheel reaches its slot above. scheduling and cancelling take constant time, and a
+  // tick touches only the entries which expire or move down, however many are scheduled.
+  class timer_wheel {
+  public:
+    // the intrusive links of a scheduled object
+    struct entry {
+      entry* prev = nullptr;
+      entry* next = nullptr;
+      std::uint64_t expires = 0;
+
+      bool scheduled() const noexcept {
+        return next != nullptr;
+      }
+    };
+
+  private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr std::size_t slots = 1 << slot_bits;
+    static constexpr std::size_t levels = 4;
+    static constexpr std::uint64_t span = std::uint64_t{1} << (slot_bits * levels);
+
+    std::array<std::array<entry, slots>, levels> heads_;  // sentinels of circular lists
+    std::uint64_t now_ = 0;
+
+    void link(entry& e) noexcept {
+      auto const delta = e.expires > now_ ? e.expires - now_ : 0;
+      std::size_t level = 0;
+      while (level + 1 < levels && delta >= std::uint64_t{1} << (slot_bits * (level + 1))) {
+        ++level;
+      }
+      auto& head = heads_[level][(e.expires >> (slot_bits * level)) & (slots - 1)];
+      e.prev = &head;
+      e.next = head.next;
+      head.next->prev = &e;
+      head.next = &e;
+    }
+
+  public:
+    timer_wheel() noexcept {
+      for (auto& level : heads_) {
+        for (auto& head : level) {
+          head.prev = head.next = &head;
+        }
+      }
+    }
+
+    timer_wheel(timer_wheel const&) = delete;
+    timer_wheel& operator=(timer_wheel const&) = delete;
+
+    // expires the entry after the given number of ticks, at least one, in place of its schedule.
+    void schedule(entry& e, std::uint64_t ticks) noexcept {
+      cancel(e);
+      e.expires = now_ + std::clamp<std::uint64_t>(ticks, 1, span - 1);
+      link(e);
+    }
+
+    void cancel(entry& e) noexcept {
+      if (e.scheduled()) {
+        e.prev->next = e.next;
+        e.next->prev = e.prev;
+        e.prev = e.next = nullptr;
+      }
+    }
+
+    // turns the wheel and calls expire with each entry whose tick is reached, after unlinking it.
+    // expire may schedule it again.
+    template <typename Expire>
+    void advance(std::uint64_t ticks, Expire&& expire) {
+      for (; ticks > 0; --ticks) {
+        ++now_;
+        for (std::size_t level = 1; level < levels; ++level) {
+          if (((now_ >> (slot_bits * (level - 1))) & (slots - 1)) != 0) {
+            break;
+          }
+          auto& head = heads_[level][(now_ >> (slot_bits * level)) & (slots - 1)];
+          while (head.next != &head) {
+            auto& e = *head.next;
+            cancel(e);
+            link(e);
+          }
+        }
+        auto& head = heads_[0][now_ & (slots - 1)];
+        while (head.next != &head) {
+          auto& e = *head.next;
+          cancel(e);
+          expire(e);
+        }
+      }
+    }
+  };
+
+  // a connection is in the timer wheel of its event loop for the timeout of what it waits for.
+  class connection : timer_wheel::entry {
+    friend class event_loop;
+
+    enum class phase : std::uint8_t {
+      header,      // the rest of the request line and headers
+      body,        // the next part of a request body
+      write,       // the client to accept queued output
+      idle,        // the next request, before the output slots are trimmed
+      keep_alive,  // the next request, trimmed
+    };
+
+    // the arena of a request and the request itself live in a pooled block while it is read and
+    // handled. a request that does not fit takes more memory from the heap, which goes with it.
+    static constexpr std::size_t arena_offset =
+        (sizeof(request_arena) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    int fd_;
+    buffer_pool::buffer request_block_;
+    request_arena* arena_ = nullptr;
+    request* request_ = nullptr;
+    output_queue output_;
+    std::size_t accounted_ = 0;   // output bytes counted in the global total
+    std::size_t reported_ = 0;    // memory counted in the total of the event loop
+    std::size_t idle_charged_ = 0;  // memory counted in the idle total of the event loop
+    std::uint32_t events_ = 0;    // events registered to epoll
+    std::uint8_t input_tier_ = 0;  // buffer pool tier of the next read
+    phase phase_ = phase::header;
+    bool pending_ = false;        // registered to be flushed in this iteration
+    bool paused_ = false;         // reading is paused by a high-water mark
+    bool closing_ = false;        // closed after the output is drained
+    bool dead_ = false;           // destroyed at the end of this iteration
+    std::uint64_t ticket_ = 0;    // of the request parked by its handler, 0 when none is
+    std::string unparsed_;        // input after the parked request, parsed when it is resumed
+
+    void begin_request(buffer_pool& pool,
+                       memory_limits const& limits,
+                       std::atomic<std::size_t>& total) {
+      request_block_ = pool.acquire(0);
+      auto* const block = request_block_.data.get();
+      arena_ = new (block)
+          request_arena{block + arena_offset, request_block_.size - arena_offset, limits, total};
+      auto& resource = arena_->resource;
+      request_ = new (resource.allocate(sizeof(request), alignof(request)))
+          request{&resource, &arena_->body};
+    }
+
+    // releases the memory of the request at once.
+    void end_request() noexcept {
+      if (request_ != nullptr) {
+        request_->~request();
+        arena_->~request_arena();
+        request_ = nullptr;
+        arena_ = nullptr;
+      }
+    }
+
+    void end_request(buffer_pool& pool) {
+      end_request();
+      pool.release(std::move(request_block_));
+    }
+
+  public:
+    explicit connection(int fd) noexcept : fd_{fd} {
+    }
+
+    connection(connection const&) = delete;
+    connection& operator=(connection const&) = delete;
+
+    ~connection() {
+      end_request();
+      ::close(fd_);
+    }
+
+    int fd() const noexcept {
+      return fd_;
+    }
+
+    // bytes held by the connection in user space. the socket buffers of the kernel are not counted.
+    std::size_t memory() const noexcept {
+      return sizeof(connection) + output_.capacity() + output_.memory() + unparsed_.capacity() +
+             (arena_ != nullptr ? arena_->charged() : 0);
+    }
+  };
+
+  // the connections of an event loop and the memory they hold, published by the loop once a
+  // second.
+  struct connection_stats {
+    std::atomic<std::size_t> connections{0};
+    std::atomic<std::size_t> memory{0};
+    std::atomic<std::size_t> idle{0};  // waiting for the next request, trimmed
+    std::atomic<std::size_t> idle_memory{0};
+    std::atomic<std::size_t> rejected{0};  // requests answered with 413, 431 or 503
+  };
+
+  // an epoll based loop serving all connections of a listening socket. requests are handled while
+  // reading, and the responses they produce are written once per connection per iteration. output
+  // the socket does not accept stays queued and is resumed on EPOLLOUT.
+  class event_loop {
+  public:
+    using handler = std::function<void(request const&, response&)>;
+    // a descriptor other than a connection, and the function called when it is readable
+    using reader = std::pair<int, std::function<void()>>;
+    // sends the response of a parked request
+    using completion = std::function<void(request const&, response&)>;
+    // hands the completion of a parked request to its event loop. may be called from any thread.
+    using resumer = std::function<void(completion)>;
+
+    struct settings {
+      output_limits limits;
+      std::atomic<std::size_t>* buffered = nullptr;  // output bytes buffered by all loops
+      nek::memory_limits memory;
+      std::atomic<std::size_t>* charged = nullptr;  // request bytes beyond the pooled blocks
+      nek::timeouts timeouts;
+      std::vector<std::pair<std::string, std::string>> default_headers;
+      std::vector<reader> readers;
+      std::shared_ptr<compression_options const> compression;
+      bool huge_pages = false;  // buffer pools in 2 MiB pages
+      connection_stats* stats = nullptr;
+    };
+
+  private:
+    socket listener_;
+    int epoll_ = -1;
+    int timer_ = -1;  // fires on wall-clock seconds to refresh the cached Date header
+    int tick_ = -1;  // fires every monotonic second to turn the wheel, whatever the wall clock does
+    int wakeup_ = -1;  // an eventfd signalled when a task is posted
+    handler handler_;
+    std::vector<reader> readers_;
+    output_limits limits_;
+    std::atomic<std::size_t>* buffered_;  // output bytes buffered by all loops
+    memory_limits memory_limits_;
+    std::atomic<std::size_t>* charged_;  // request bytes of all loops beyond the pooled blocks
+    connection_stats* stats_;
+    nek::timeouts timeouts_;
+    buffer_pool buffers_;
+    slab<connection> slab_;
+    timer_wheel wheel_;
+    std::unordered_map<int, connection*> connections_;
+    std::size_t memory_ = 0;  // held by the connections, kept up to date for the stats
+    std::size_t idle_ = 0;  // trimmed connections waiting for the next request
+    std::size_t idle_memory_ = 0;  // held by them, with their nodes in connections_
+    std::vector<connection*> pending_;
+    std::vector<connection*> paused_;
+    std::vector<connection*> closed_;  // destroyed at the end of this iteration
+    std::mutex posted_mutex_;
+    std::vector<std::function<void()>> posted_;  // by other threads, run on this one
+    connection* handling_ = nullptr;  // whose request the handler is called for
+    std::uint64_t tickets_ = 0;
+    std::unordered_map<std::uint64_t, connection*> parked_;  // by ticket
+    inline static thread_local event_loop* current_ = nullptr;
+
+    void watch(int fd, std::uint32_t events, void* data) {
+      ::epoll_event ev{};
+      ev.events = events;
+      ev.data.ptr = data;
+      if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        throw std::system_error{errno, std::generic_category(), "epoll_ctl"};
+      }
+    }
+
+    // registers EPOLLIN unless reading is paused or a request is parked, and EPOLLOUT while output
+    // is blocked.
+    void update_events(connection& conn) {
+      std::uint32_t events =
+          conn.paused_ || conn.closing_ || conn.ticket_ != 0 ? 0 : EPOLLIN | EPOLLRDHUP;
+      if (!conn.output_.empty()) {
+        events |= EPOLLOUT;
+      }
+      if (events == conn.events_) {
+        return;
+      }
+      ::epoll_event ev{};
+      ev.events = events;
+      ev.data.ptr = &conn;
+      if (::epoll_ctl(epoll_, EPOLL_CTL_MOD, conn.fd_, &ev) != 0) {
+        throw std::system_error{errno, std::generic_category(), "epoll_ctl"};
+      }
+      conn.events_ = events;
+    }
+
+    void account(connection& conn) noexcept {
+      auto const memory = conn.output_.memory();
+      if (memory >= conn.accounted_) {
+        buffered_->fetch_add(memory - conn.accounted_, std::memory_order_relaxed);
+      } else {
+        buffered_->fetch_sub(conn.accounted_ - memory, std::memory_order_relaxed);
+      }
+      conn.accounted_ = memory;
+      memory_ = memory_ - conn.reported_ + conn.memory();
+      conn.reported_ = conn.memory();
+    }
+
+    void mark_dead(connection& conn) {
+      if (!conn.dead_) {
+        conn.dead_ = true;
+        closed_.push_back(&conn);
+      }
+    }
+
+    // whole ticks of the timer, one more than the seconds so that a timeout never fires early
+    static std::uint64_t ticks(std::chrono::seconds timeout) noexcept {
+      return static_cast<std::uint64_t>(std::max<std::chrono::seconds::rep>(timeout.count(), 0)) +
+             1;
+    }
+
+    // about the heap memory of an entry of connections_: its node, which links to the next one,
+    // and its bucket
+    static constexpr std::size_t connection_node_size =
+        sizeof(void*) + sizeof(std::pair<int const, connection*>) + sizeof(void*);
+
+    // idle connections keep their output slots this long, for clients sending requests in quick
+    // succession
+    static constexpr std::uint64_t linger_ticks = 2;
+
+    // moves the connection to the phase of what it waits for now and starts its timeout. the
+    // deadline of an unchanged phase stays, except that reading restarts a body timeout and
+    // writing a write timeout. so headers trickling in do not extend their deadline.
+    void arm(connection& conn, bool read, bool wrote) {
+      using phase = connection::phase;
+      auto next = phase::idle;
+      if (!conn.output_.empty()) {
+        next = phase::write;
+      } else if (conn.request_ != nullptr) {
+        next = conn.request_->state_ == parse_state::body ? phase::body : phase::header;
+      }
+      if (conn.phase_ == phase::keep_alive) {
+        if (next == phase::idle) {
+          return;
+        }
+        --idle_;
+        idle_memory_ -= conn.idle_charged_;
+      } else if (next == conn.phase_ && !(next == phase::body && read) &&
+                 !(next == phase::write && wrote)) {
+        return;
+      }
+      conn.phase_ = next;
+      switch (next) {
+        case phase::header:
+          wheel_.schedule(conn, ticks(timeouts_.header));
+          break;
+        case phase::body:
+          wheel_.schedule(conn, ticks(timeouts_.body));
+          break;
+        case phase::write:
+          wheel_.schedule(conn, ticks(timeouts_.write));
+          break;
+        default:
+          wheel_.schedule(conn, std::min(linger_ticks, ticks(timeouts_.keep_alive)));
+          break;
+      }
+    }
+
+    // a connection waiting past its timeout is closed, after a 408 when it has sent part of a
+    // request. an idle one is trimmed first, so that it holds only its slot and descriptor.
+    void expire(connection& conn) {
+      switch (conn.phase_) {
+        case connection::phase::idle:
+          conn.output_.trim();
+          account(conn);
+          conn.phase_ = connection::phase::keep_alive;
+          ++idle_;
+          conn.idle_charged_ = conn.memory() + connection_node_size;
+          idle_memory_ += conn.idle_charged_;
+          if (auto const keep_alive = ticks(timeouts_.keep_alive); keep_alive > linger_ticks) {
+            wheel_.schedule(conn, keep_alive - linger_ticks);
+            break;
+          }
+          mark_dead(conn);
+          break;
+        case connection::phase::header:
+        case connection::phase::body:
+          if (conn.request_ != nullptr) {
+            reject(conn, 408);
+            account(conn);
+            schedule_flush(conn);
+            arm(conn, false, false);
+            break;
+          }
+          mark_dead(conn);
+          break;
+        default:
+          mark_dead(conn);
+          break;
+      }
+    }
+
+    bool over_high_water(connection const& conn) const noexcept {
+      return conn.output_.memory() >= limits_.connection_high_water ||
+             buffered_->load(std::memory_order_relaxed) >= limits_.global_high_water;
+    }
+
+    bool under_low_water(connection const& conn) const noexcept {
+      return conn.output_.memory() < limits_.connection_high_water / 2 &&
+             buffered_->load(std::memory_order_relaxed) < limits_.global_high_water / 2;
+    }
+
+    void schedule_flush(connection& conn) {
+      if (!conn.pending_) {
+        conn.pending_ = true;
+        pending_.push_back(&conn);
+      }
+    }
+
+    void accept_all() {
+      int fd;
+      while ((fd = listener_.accept()) >= 0) {
+        auto* const conn = slab_.make(fd);
+        conn->events_ = EPOLLIN | EPOLLRDHUP;
+        try {
+          watch(fd, conn->events_, conn);
+          connections_.emplace(fd, conn);
+        } catch (...) {
+          slab_.destroy(conn);
+          throw;
+        }
+        account(*conn);
+        wheel_.schedule(*conn, ticks(timeouts_.header));
+      }
+    }
+
+    // answers with an error status and closes the connection once the output is written. the
+    // request is released first, since its arena may be exhausted.
+    void reject(connection& conn, int status) {
+      unpark(conn);
+      conn.end_request(buffers_);
+      request req;
+      req.http_version_ = "1.1";
+      req.protocol_ = "HTTP";
+      req.close_ = true;
+      response res{req, conn.output_};
+      if (status == 503) {
+        res.set_header("Retry-After", "1");
+      }
+      res.status(status).send("");
+      conn.closing_ = true;
+      if (stats_ != nullptr && (status == 413 || status == 431 || status == 503)) {
+        stats_->rejected.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    bool over_budget(connection const& conn) const noexcept {
+      auto const charged = conn.output_.memory() + conn.arena_->charged();
+      auto const total =
+          buffered_->load(std::memory_order_relaxed) + charged_->load(std::memory_order_relaxed);
+      return charged > memory_limits_.connection || total > memory_limits_.global;
+    }
+
+    void handle(connection& conn) {
+      auto& req = *conn.request_;
+      if (req.state_ == parse_state::invalid) {
+        reject(conn, 400);
+        return;
+      }
+      if (over_budget(conn)) {
+        reject(conn, 503);
+        return;
+      }
+      // TODO: get hostname from Host header
+      req.hostname_ = "localhost";
+      respond(conn, handler_);
+    }
+
+    // calls the handler of the request, or the completion of a parked one, and closes the
+    // connection after the response unless the request keeps it alive.
+    template <typename Handler>
+    void respond(connection& conn, Handler const& h) {
+      auto& req = *conn.request_;
+      response res{req, conn.output_};
+      handling_ = &conn;
+      auto keep_alive = false;
+      try {
+        h(req, res);
+        keep_alive = req.keep_alive();
+      } catch (memory_budget_exceeded const&) {
+        handling_ = nullptr;
+        if (!res.sent()) {
+          reject(conn, 503);
+          return;
+        }
+        conn.closing_ = true;
+      } catch (...) {
+        handling_ = nullptr;
+        throw;
+      }
+      handling_ = nullptr;
+      if (conn.ticket_ == 0 && !keep_alive) {
+        conn.closing_ = true;
+      }
+    }
+
+    // checks the length of a request body before it is read and takes its memory at once from
+    // the body budget. returns false when the request is rejected.
+    bool admit_body(connection& conn) {
+      auto& req = *conn.request_;
+      if (req.body_remaining_ > memory_limits_.request_body) {
+        reject(conn, 413);
+        return false;
+      }
+      try {
+        req.body_.reserve(req.body_remaining_);
+      } catch (memory_budget_exceeded const&) {
+        reject(conn, 413);
+        return false;
+      }
+      return true;
+    }
+
+    void unpark(connection& conn) {
+      if (conn.ticket_ != 0) {
+        parked_.erase(conn.ticket_);
+        conn.ticket_ = 0;
+      }
+    }
+
+    // parses and handles the requests in data. when a handler parks its request, the rest of the
+    // data is kept with the connection until the request is resumed.
+    void feed(connection& conn, char const* data, std::size_t size) {
+      std::size_t offset = 0;
+      while (offset < size && !conn.closing_) {
+        if (conn.request_ == nullptr) {
+          conn.begin_request(buffers_, memory_limits_, *charged_);
+        }
+        try {
+          offset += conn.request_->parse_and_build(data + offset, size - offset);
+        } catch (memory_budget_exceeded const&) {
+          reject(conn, 431);
+          break;
+        }
+        if (conn.request_->state_ == parse_state::body && conn.request_->body_.empty() &&
+            !admit_body(conn)) {
+          break;
+        }
+        if (conn.request_->state_ == parse_state::done ||
+            conn.request_->state_ == parse_state::invalid) {
+          handle(conn);
+          if (conn.ticket_ != 0) {
+            conn.unparsed_.assign(data + offset, size - offset);
+            return;
+          }
+          conn.end_request(buffers_);
+        }
+      }
+    }
+
+    // sends the response of a parked request and goes on with the input which followed it.
+    void resume(std::uint64_t ticket, completion const& complete) {
+      auto const it = parked_.find(ticket);
+      if (it == parked_.end()) {
+        return;  // the connection has been closed
+      }
+      auto& conn = *it->second;
+      unpark(conn);
+      try {
+        respond(conn, complete);
+        if (conn.ticket_ == 0) {
+          conn.end_request(buffers_);
+          std::string input;
+          input.swap(conn.unparsed_);
+          feed(conn, input.data(), input.size());
+        }
+        account(conn);
+        schedule_flush(conn);
+        arm(conn, false, false);
+      } catch (std::exception const& ex) {
+        std::cerr << ex.what() << std::endl;
+        mark_dead(conn);
+      }
+    }
+
+    // runs the tasks posted by other threads.
+    void run_posted() {
+      std::uint64_t count = 0;
+      while (::read(wakeup_, &count, sizeof(count)) < 0 && errno == EINTR) {
+      }
+      std::vector<std::function<void()>> tasks;
+      {
+        std::lock_guard<std::mutex> lock{posted_mutex_};
+        tasks.swap(posted_);
+      }
+      for (auto& task : tasks) {
+        task();
+      }
+    }
+
+    // reads into a pooled buffer which goes back to the pool when the socket is drained, so an idle
+    // connection holds none. a read filling the buffer moves the connection to a larger tier, and
+    // a small last read to a smaller one.
+    void on_readable(connection& conn) {
+      auto input = buffers_.acquire(conn.input_tier_);
+      std::size_t last_read = 0;
+      auto read = false;
+      while (!conn.closing_ && conn.ticket_ == 0) {
+        if (over_high_water(conn)) {
+          conn.paused_ = true;
+          paused_.push_back(&conn);
+          break;
+        }
+        auto* const buffer = reinterpret_cast<char*>(input.data.get());
+        auto const recv_size = ::recv(conn.fd_, buffer, input.size, 0);
+        if (recv_size == 0) {
+          conn.closing_ = true;
+          break;
+        }
+        if (recv_size < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mark_dead(conn);
+          }
+          break;
+        }
+        read = true;
+        feed(conn, buffer, static_cast<std::size_t>(recv_size));
+        account(conn);
+        last_read = static_cast<std::size_t>(recv_size);
+        if (last_read == input.size && input.tier + 1 < buffer_pool::tiers) {
+          buffers_.release(std::move(input));
+          input = buffers_.acquire(++conn.input_tier_);
+        }
+      }
+      if (conn.input_tier_ > 0 && last_read < input.size / 4) {
+        --conn.input_tier_;
+      }
+      buffers_.release(std::move(input));
+      schedule_flush(conn);
+      if (!conn.dead_) {
+        arm(conn, read, false);
+      }
+    }
+
+    void flush_pending() {
+      for (auto* conn : pending_) {
+        conn->pending_ = false;
+        if (conn->dead_) {
+          continue;
+        }
+        try {
+          auto const queued = conn->output_.size();
+          auto const drained = conn->output_.flush(conn->fd_);
+          account(*conn);
+          if (drained && conn->closing_) {
+            mark_dead(*conn);
+            continue;
+          }
+          update_events(*conn);
+          arm(*conn, false, conn->output_.size() < queued);
+        } catch (std::exception const& ex) {
+          std::cerr << ex.what() << std::endl;
+          mark_dead(*conn);
+        }
+      }
+      pending_.clear();
+    }
+
+    // resumes reading from the paused connections whose output has been drained enough.
+    void resume_paused() {
+      auto const resumable = [this](connection* conn) {
+        if (conn->dead_ || !under_low_water(*conn)) {
+          return false;
+        }
+        conn->paused_ = false;
+        update_events(*conn);
+        return true;
+      };
+      paused_.erase(std::remove_if(paused_.begin(), paused_.end(), resumable), paused_.end());
+    }
+
+    void destroy_dead() {
+      if (!paused_.empty()) {
+        paused_.erase(std::remove_if(paused_.begin(), paused_.end(),
+                                     [](connection* conn) { return conn->dead_; }),
+                      paused_.end());
+      }
+      for (auto* const conn : closed_) {
+        buffered_->fetch_sub(conn->accounted_, std::memory_order_relaxed);
+        memory_ -= conn->reported_;
+        if (conn->phase_ == connection::phase::keep_alive) {
+          --idle_;
+          idle_memory_ -= conn->idle_charged_;
+        }
+        unpark(*conn);
+        wheel_.cancel(*conn);
+        conn->end_request(buffers_);
+        connections_.erase(conn->fd_);
+        slab_.destroy(conn);
+      }
+      closed_.clear();
+    }
+
+    // creates a timerfd which fires every second from first on clock.
+    static int every_second(::clockid_t clock, int flags, ::time_t first) {
+      auto const fd = ::timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+      }
+      ::itimerspec spec{};
+      spec.it_interval.tv_sec = 1;
+      spec.it_value.tv_sec = first;
+      if (::timerfd_settime(fd, flags, &spec, nullptr) != 0) {
+        auto const error = errno;
+        ::close(fd);
+        throw std::system_error{error, std::generic_category(), "timerfd_settime"};
+      }
+      return fd;
+    }
+
+    static std::uint64_t expirations(int fd) noexcept {
+      std::uint64_t count = 0;
+      while (::read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+      }
+      return count;
+    }
+
+    void on_timer() {
+      expirations(timer_);
+      header_preamble::local().refresh(std::time(nullptr));
+    }
+
+    // expires the timeouts of the ticks since the last one and publishes the connection stats,
+    // which are kept up to date as connections change, so no connection is visited otherwise.
+    void on_tick() {
+      wheel_.advance(expirations(tick_), [this](timer_wheel::entry& e) {
+        auto& conn = static_cast<connection&>(e);
+        if (!conn.dead_) {
+          expire(conn);
+        }
+      });
+      if (stats_ != nullptr) {
+        stats_->connections.store(connections_.size(), std::memory_order_relaxed);
+        stats_->memory.store(memory_, std::memory_order_relaxed);
+        stats_->idle.store(idle_, std::memory_order_relaxed);
+        stats_->idle_memory.store(idle_memory_, std::memory_order_relaxed);
+      }
+    }
+
+  public:
+    event_loop(int port, handler h, settings s)
+        : listener_{port},
+          handler_{std::move(h)},
+          readers_{std::move(s.readers)},
+          limits_{s.limits},
+          buffered_{s.buffered},
+          memory_limits_{s.memory},
+          charged_{s.charged},
+          stats_{s.stats},
+          timeouts_{s.timeouts},
+          buffers_{s.huge_pages} {
+      listener_.connect();
+      listener_.listen();
+      if ((epoll_ = ::epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        throw std::system_error{errno, std::generic_category(), "epoll_create1"};
+      }
+      watch(listener_.fd(), EPOLLIN, &listener_);
+      // fire on wall-clock second boundaries so the Date header changes when the second does.
+      // a clock step fires it early or late, which is why the wheel has its own timer.
+      ::timespec now;
+      ::clock_gettime(CLOCK_REALTIME, &now);
+      timer_ = every_second(CLOCK_REALTIME, TFD_TIMER_ABSTIME, now.tv_sec + 1);
+      watch(timer_, EPOLLIN, &timer_);
+      tick_ = every_second(CLOCK_MONOTONIC, 0, 1);
+      watch(tick_, EPOLLIN, &tick_);
+      if ((wakeup_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        throw std::system_error{errno, std::generic_category(), "eventfd"};
+      }
+      watch(wakeup_, EPOLLIN, &wakeup_);
+      for (auto& r : readers_) {
+        watch(r.first, EPOLLIN, &r);
+      }
+      header_preamble::local().reset(s.default_headers);
+      content_encoder::local().configure(std::move(s.compression));
+    }
+
+    event_loop(event_loop const&) = delete;
+    event_loop& operator=(event_loop const&) = delete;
+
+    ~event_loop() {
+      for (auto const& [fd, conn] : connections_) {
+        buffered_->fetch_sub(conn->accounted_, std::memory_order_relaxed);
+        slab_.destroy(conn);
+      }
+      connections_.clear();
+      if (timer_ >= 0) {
+        ::close(timer_);
+      }
+      if (tick_ >= 0) {
+        ::close(tick_);
+      }
+      if (wakeup_ >= 0) {
+        ::close(wakeup_);
+      }
+      if (epoll_ >= 0) {
+        ::close(epoll_);
+      }
+    }
+
+    // runs a task on the thread of this loop. may be called from any thread.
+    void post(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock{posted_mutex_};
+        posted_.push_back(std::move(task));
+      }
+      std::uint64_t const one = 1;
+      while (::write(wakeup_, &one, sizeof(one)) < 0 && errno == EINTR) {
+      }
+    }
+
+    // parks the request whose handler runs on this thread: nothing is sent when the handler
+    // returns, and the connection reads no further request until the returned resumer is called
+    // with the completion of the response. returns an empty resumer outside of a handler.
+    static resumer park() {
+      auto* const loop = current_;
+      if (loop == nullptr || loop->handling_ == nullptr || loop->handling_->ticket_ != 0) {
+        return {};
+      }
+      auto& conn = *loop->handling_;
+      conn.ticket_ = ++loop->tickets_;
+      loop->parked_.emplace(conn.ticket_, &conn);
+      return [loop, ticket = conn.ticket_](completion complete) {
+        loop->post([loop, ticket, complete = std::move(complete)] {
+          loop->resume(ticket, complete);
+        });
+      };
+    }
+
+    void run() {
+      current_ = this;
+      ::epoll_event events[64];
+      while (true) {
+        auto const n = ::epoll_wait(epoll_, events, std::size(events), -1);
+        if (n < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          throw std::system_error{errno, std::generic_category(), "epoll_wait"};
+        }
+        for (auto i = 0; i < n; ++i) {
+          if (events[i].data.ptr == &listener_) {
+            accept_all();
+            continue;
+          }
+          if (events[i].data.ptr == &timer_) {
+            on_timer();
+            continue;
+          }
+          if (events[i].data.ptr == &tick_) {
+            on_tick();
+            continue;
+          }
+          if (events[i].data.ptr == &wakeup_) {
+            run_posted();
+            continue;
+          }
+          auto const r = std::find_if(readers_.begin(), readers_.end(),
+                                      [&](reader const& r) { return &r == events[i].data.ptr; });
+          if (r != readers_.end()) {
+            r->second();
+            continue;
+          }
+          auto& conn = *static_cast<connection*>(events[i].data.ptr);
+          if (conn.dead_) {
+            continue;
+          }
+          auto const ev = events[i].events;
+          try {
+            if (ev & EPOLLOUT) {
+              schedule_flush(conn);
+            }
+            if ((ev & (EPOLLIN | EPOLLRDHUP)) && !conn.paused_ && conn.ticket_ == 0) {
+              on_readable(conn);
+            } else if (ev & (EPOLLERR | EPOLLHUP)) {
+              mark_dead(conn);
+            }
+          } catch (std::exception const& ex) {
+            std::cerr << ex.what() << std::endl;
+            mark_dead(conn);
+          }
+        }
+        flush_pending();
+        if (!paused_.empty()) {
+          resume_paused();
+        }
+        if (!closed_.empty()) {
+          destroy_dead();
+        }
+      }
+    }
+  };
+
+  class server {
+    std::vector<std::thread> threads_;
+    // of each event loop, all created before the first loop starts, since /_stats reads them
+    std::vector<connection_stats> connection_stats_;
+    std::size_t workers_ = 1;
+    bool huge_pages_ = false;
+    nek::output_limits output_limits_;
+    std::atomic<std::size_t> buffered_{0};
+    nek::memory_limits memory_limits_;
+    std::atomic<std::size_t> charged_{0};
+    nek::timeouts timeouts_;
+    std::vector<std::pair<std::string, std::string>> default_headers_ = {{"Server", "nhs"}};
+    std::vector<static_files> statics_;
+    std::optional<asset_cache_limits> asset_cache_limits_;
+    std::unique_ptr<asset_cache> assets_;
+    std::optional<file_cache_limits> file_cache_limits_;
+    std::unique_ptr<file_cache> files_;
+    std::unique_ptr<file_watcher> watcher_;
+    std::shared_ptr<compression_options const> compression_;
+    std::vector<std::shared_ptr<nek::compression_dictionary const>> dictionaries_;
+    std::optional<segment_store_options> segment_store_options_;
+    std::unique_ptr<segment_store> segments_;
+    struct route {
+      std::regex pattern;  // compiled once, since a std::regex allocates a lot
+      bool literal = false;  // a path without special characters is compared without the regex
+      std::function<void(request const&, response&)> callback;
+      std::shared_ptr<nek::microcache> cache;
+    };
+    std::unordered_map<std::string, std::unordered_map<std::string, route>> callbacks_;
+    std::unique_ptr<worker> refresher_;  // renders the stale microcache entries again
+
+    route& route_of(std::string const& method, std::string const& path) {
+      auto [it, inserted] = callbacks_[method].try_emplace(path);
+      if (inserted) {
+        it->second.pattern = std::regex{path};
+        it->second.literal = path.find_first_of(R"(\^$.|?*+()[]{})") == std::string::npos;
+      }
+      return it->second;
+    }
+
+    // the microcaches of the GET routes. looking them up adds no route, so it is safe while the
+    // event loops dispatch.
+    std::vector<nek::microcache*> microcaches() const {
+      std::vector<nek::microcache*> caches;
+      if (auto const gets = callbacks_.find("GET"); gets != callbacks_.end()) {
+        for (auto const& [path, route] : gets->second) {
+          if (route.cache) {
+            caches.push_back(route.cache.get());
+          }
+        }
+      }
+      return caches;
+    }
+
+    void dispatch(request const& req, response& res) const {
+      auto const target_method_callbacks = callbacks_.find(std::string{req.method()});
+      if (target_method_callbacks != callbacks_.end()) {
+        // the match state is allocated from the arena of the request
+        std::match_results<std::pmr::string::const_iterator,
+                           std::pmr::polymorphic_allocator<std::sub_match<
+                               std::pmr::string::const_iterator>>>
+            match{req.arena()};
+        for (auto const& [path, route] : target_method_callbacks->second) {
+          if (!route.callback ||
+              !(route.literal ? req.path() == path
+                              : std::regex_match(req.path_, match, route.pattern))) {
+            continue;
+          }
+          // a conditional request is answered with 304 from the cached entry's validators
+          if (route.cache) {
+            auto key = route.cache->key(req);
+            auto leader = false;
+            auto refresh = false;
+            auto parked = false;
+            // a miss of a key being rendered parks the request until the leader lands
+            auto const join = [&route, &parked]() -> microcache::waiter {
+              auto resume = event_loop::park();
+              if (!resume) {
+                return {};
+              }
+              parked = true;
+              return [&route, resume = std::move(resume)](std::optional<cached_response> result) {
+                resume([&route, result = std::move(result)](request const& req, response& res) {
+                  if (result) {
+                    res.send(*result);
+                    return;
+                  }
+                  route.callback(req, res);
+                  if (!res.sent()) {
+                    res.status(404).send("");
+                  }
+                });
+              };
+            };
+            if (auto const hit = route.cache->find(key, leader, refresh, join)) {
+              res.send(*hit);
+              if (refresh) {
+                // the stale response is sent at once while the fresh one is rendered off the
+                // loops. a refresh which throws leaves the stale entry for stale_if_error.
+                refresher_->post([req, &route, key = std::move(key)] {
+                  output_queue discarded;
+                  response fresh{req, discarded};
+                  fresh.cache_in(*route.cache, key);
+                  try {
+                    route.callback(req, fresh);
+                  } catch (std::exception const& ex) {
+                    std::cerr << ex.what() << std::endl;
+                  } catch (...) {
+                    std::cerr << "unknown error" << std::endl;
+                  }
+                  route.cache->refreshed(key);
+                });
+              }
+              continue;
+            }
+            if (leader) {
+              res.cache_in(*route.cache, key);
+              try {
+                route.callback(req, res);
+              } catch (...) {
+                route.cache->land(key);
+                throw;
+              }
+              route.cache->land(key);
+              continue;
+            }
+            if (parked) {
+              return;
+            }
+          }
+          route.callback(req, res);
+        }
+      }
+      if (!res.sent() && (req.method() == "GET" || req.method() == "HEAD")) {
+        for (auto const& statics : statics_) {
+          if (statics.serve(req, res)) {
+            return;
+          }
+        }
+      }
+      if (!res.sent()) {
+        res.status(404).send("");
+      }
+    }
+
+  public:
+    ~server() noexcept {
+      try {
+        for (auto& thread : threads_) {
+          if (thread.joinable()) {
+            thread.join();
+          }
+        }
+      } catch (...) {
+      }
+    }
+
+    // runs count event loops on their own threads. each has a listener of the port with
+    // SO_REUSEPORT, so the kernel balances connections among them.
+    server& workers(std::size_t count) noexcept {
+      workers_ = std::max<std::size_t>(count, 1);
+      return *this;
+    }
+
+    // takes the read buffers and request arenas of the event loops from 2 MiB pages, which cuts
+    // dTLB misses with many connections. see nhs-bench-tlb.
+    server& huge_pages(bool enabled = true) noexcept {
+      huge_pages_ = enabled;
+      return *this;
+    }
+
+    server& output_limits(nek::output_limits limits) noexcept {
+      output_limits_ = limits;
+      return *this;
+    }
+
+    server& memory_limits(nek::memory_limits limits) noexcept {
+      memory_limits_ = limits;
+      return *this;
+    }
+
+    // closes the connections of clients too slow to send a request or to read a response.
+    server& timeouts(nek::timeouts limits) noexcept {
+      timeouts_ = limits;
+      return *this;
+    }
+
+    // adds a header sent with every response, or replaces the value of a default one. Date is
+    // always sent with the current time, so it cannot be given here.
+    server& default_header(std::string const& header, std::string const& value) {
+      if (iequals(header, "date")) {
+        throw std::invalid_argument{"default_header: Date is set by the server"};
+      }
+      auto const it = std::find_if(default_headers_.begin(), default_headers_.end(),
+                                   [&](auto const& h) { return iequals(h.first, header); });
+      if (it != default_headers_.end()) {
+        it->second = value;
+      } else {
+        default_headers_.emplace_back(header, value);
+      }
+      return *this;
+    }
+
+    // serves the files under root for the paths starting with prefix when no callback responds.
+    server& serve_static(std::string prefix,
+                         std::filesystem::path root,
+                         static_options options = {}) {
+      statics_.emplace_back(std::move(prefix), std::move(root), options);
+      return *this;
+    }
+
+    // keeps small static files in memory. entries are invalidated by inotify events under the
+    // static roots.
+    server& cache_assets(asset_cache_limits limits = {}) {
+      asset_cache_limits_ = limits;
+      return *this;
+    }
+
+    // keeps static files open between requests. entries are invalidated by inotify events under
+    // the static roots or after the TTL.
+    server& cache_files(file_cache_limits limits = {}) {
+      file_cache_limits_ = limits;
+      return *this;
+    }
+
+    // compresses the responses of callbacks on the fly for the clients which accept it.
+    server& compress(compression_options options = {}) {
+      compression_ = std::make_shared<compression_options const>(std::move(options));
+      return *this;
+    }
+
+    // keeps the microcache entries evicted from memory in segment files under a directory. the
+    // entries found there are kept across restarts.
+    server& spill_to_disk(segment_store_options options) {
+      segment_store_options_ = std::move(options);
+      return *this;
+    }
+
+    // loads a raw dictionary for the compressed responses to the paths matching match, where '*'
+    // matches any characters. it is served at url with Use-As-Dictionary, and the clients which
+    // keep it receive dcz or dcb responses against it. compress() must be called as well.
+    server& compression_dictionary(std::filesystem::path const& file,
+                                   std::string url,
+                                   std::string match) {
+      auto dictionary = read_compression_dictionary(file, url, std::move(match));
+      dictionaries_.push_back(dictionary);
+      auto const headers = std::make_shared<std::string const>(
+          "Content-Type: application/octet-stream\r\nCache-Control: public, max-age=86400\r\n"
+          "Use-As-Dictionary: match=\"" +
+          dictionary->match + "\"\r\n");
+      return get(url, [dictionary, headers](request const&, response& res) {
+        buffer_chain chain;
+        chain.append_shared(dictionary->content);
+        res.header_block(headers).send(std::move(chain));
+      });
+    }
+
+    // drops the microcache entries tagged with a surrogate key and returns how many there were.
+    std::size_t purge(std::string const& tag) const {
+      std::size_t purged = 0;
+      for (auto* const cache : microcaches()) {
+        purged += cache->purge(tag);
+      }
+      return purged;
+    }
+
+    // purges the surrogate keys listed in the Surrogate-Key header of POST or PURGE requests to
+    // path. with a token, only the requests with "Authorization: Bearer <token>" are accepted.
+    server& serve_purge(std::string const& path, std::string token = {}) {
+      auto const purge = [this, expected = token.empty() ? token : "Bearer " + token](
+                             request const& req, response& res) {
+        if (!expected.empty() && !constant_time_equals(req.header("authorization"), expected)) {
+          res.status(403).send("");
+          return;
+        }
+        std::size_t purged = 0;
+        auto keys = std::string_view{req.header("surrogate-key")};
+        while (!keys.empty()) {
+          auto const space = keys.find(' ');
+          if (auto const key = keys.substr(0, space); !key.empty()) {
+            purged += this->purge(std::string{key});
+          }
+          keys.remove_prefix(space == std::string_view::npos ? keys.size() : space + 1);
+        }
+        res.set_header("Content-Type", "text/plain; charset=utf-8");
+        buffer_chain body;
+        body.append("purged " + std::to_string(purged) + "\n");
+        res.send(std::move(body));
+      };
+      route_of("POST", path).callback = purge;
+      route_of("PURGE", path).callback = purge;
+      return *this;
+    }
+
+    // serves counters of the caches as plain text.
+    server& serve_stats(std::string const& path) {
+      return get(path, [this](request const&, response& res) {
+        std::string body;
+        auto const counter = [&body](std::string_view name, std::uint64_t value) {
+          body.append(name).append(" ").append(std::to_string(value)).append("\n");
+        };
+        if (files_) {
+          auto const stats = files_->stats();
+          counter("file_cache_hits", stats.hits);
+          counter("file_cache_misses", stats.misses);
+          counter("file_cache_evictions", stats.evictions);
+          counter("file_cache_invalidations", stats.invalidations);
+        }
+        if (!connection_stats_.empty()) {
+          std::size_t connections = 0;
+          std::size_t memory = 0;
+          std::size_t idle = 0;
+          std::size_t idle_memory = 0;
+          std::size_t rejected = 0;
+          for (auto const& loop : connection_stats_) {
+            connections += loop.connections.load(std::memory_order_relaxed);
+            memory += loop.memory.load(std::memory_order_relaxed);
+            idle += loop.idle.load(std::memory_order_relaxed);
+            idle_memory += loop.idle_memory.load(std::memory_order_relaxed);
+            rejected += loop.rejected.load(std::memory_order_relaxed);
+          }
+          counter("connections", connections);
+          counter("connection_memory_bytes", memory);
+          counter("idle_connections", idle);
+          counter("idle_connection_memory_bytes", idle_memory);
+          counter("memory_per_idle_connection_bytes", idle > 0 ? idle_memory / idle : 0);
+          counter("rejected_requests", rejected);
+        }
+        res.set_header("Content-Type", "text/plain; charset=utf-8");
+        buffer_chain chain;
+        chain.append(std::move(body));
+        res.send(std::move(chain));
+      });
+    }
+
+    template <typename Callback>
+    server& get(std::string const& path, Callback&& callback) {
+      route_of("GET", path).callback = std::forward<Callback>(callback);
+      return *this;
+    }
+
+    // keeps the responses of the GET route of path for a TTL and sends them without calling the
+    // callback again.
+    server& microcache(std::string const& path, microcache_options options = {}) {
+      route_of("GET", path).cache = std::make_shared<nek::microcache>(std::move(options));
+      return *this;
+    }
+
+    void listen(int port) {
+      auto compression = compression_;
+      if (compression && !dictionaries_.empty()) {
+        auto options = *compression;
+        options.dictionaries = dictionaries_;
+        compression = std::make_shared<compression_options const>(std::move(options));
+      }
+      event_loop::settings settings{output_limits_, &buffered_, memory_limits_, &charged_,
+                                    timeouts_, default_headers_, {}, compression, huge_pages_};
+      auto const caches = microcaches();
+      if (segment_store_options_) {
+        segments_ = std::make_unique<segment_store>(*segment_store_options_);
+        for (auto* const cache : caches) {
+          cache->spill_to(segments_.get());
+        }
+      }
+      if (!caches.empty()) {
+        // the refreshes render responses like the event loops do
+        refresher_ = std::make_unique<worker>([headers = default_headers_, compression] {
+          header_preamble::local().reset(headers);
+          content_encoder::local().configure(compression);
+        });
+      }
+      auto& readers = settings.readers;
+      if ((asset_cache_limits_ || file_cache_limits_) && !statics_.empty()) {
+        watcher_ = std::make_unique<file_watcher>();
+        if (asset_cache_limits_) {
+          assets_ = std::make_unique<asset_cache>(*asset_cache_limits_);
+          // sidecars served from memory are not checked against their original, so they go too
+          watcher_->subscribe([cache = assets_.get()](std::filesystem::path const& path,
+                                                      bool tree) {
+            cache->invalidate(path, tree);
+            if (!tree) {
+              for (auto const& sidecar : precompressed_sidecars) {
+                cache->invalidate(path.native() + std::string{sidecar.second}, false);
+              }
+            }
+          });
+        }
+        if (file_cache_limits_) {
+          files_ = std::make_unique<file_cache>(*file_cache_limits_);
+          watcher_->subscribe([cache = files_.get()](std::filesystem::path const& path,
+                                                     bool tree) { cache->invalidate(path, tree); });
+        }
+        for (auto& statics : statics_) {
+          statics.cache(assets_.get());
+          statics.cache(files_.get());
+          watcher_->watch_tree(statics.root());
+        }
+        readers.emplace_back(watcher_->fd(),
+                             [watcher = watcher_.get()] { watcher->on_readable(); });
+      }
+      connection_stats_ = std::vector<connection_stats>(workers_);
+      for (std::size_t i = 0; i < workers_; ++i) {
+        // the shared readers are served by the first loop only
+        auto worker_settings = settings;
+        if (i > 0) {
+          worker_settings.readers.clear();
+        }
+        worker_settings.stats = &connection_stats_[i];
+        threads_.emplace_back([this, port, settings = std::move(worker_settings)]() mutable {
+          try {
+            event_loop loop{port,
+                            [this](request const& req, response& res) { dispatch(req, res); },
+                            std::move(settings)};
+            loop.run();
+          } catch (std::exception const& ex) {
+            std::cerr << ex.what() << std::endl;
+          } catch (...) {
+            std::cerr << "unknown error" << std::endl;
+          }
+        });
+      }
+    }
+  };
+}
+
+struct parsed_command {
+  std::string path;
+  // a raw compression dictionary for the pages, see nhs-train-dictionary
+  std::string dictionary;
+  std::string cache_dir;    // where the page cache spills to disk
+  std::string purge_token;  // enables purging the page cache by surrogate keys at /_purge
+  bool huge_pages = false;
+};
 
 parsed_command parse_command(int argc, char** argv) {
   // location of execution file is is difference when debugging by F5 and executing by cmake.
   // so, this server allows to recieve the relative path of index.html.
-  static ::option longopts[] = {{"path", optional_argument, nullptr, 'p'}};
+  // beyond the characters, so that --huge-pages has no short option and -h stays free for a help
+  constexpr int huge_pages_option = 256;
+  static ::option longopts[] = {{"path", optional_argument, nullptr, 'p'},
+                                {"dictionary", required_argument, nullptr, 'd'},
+                                {"cache-dir", required_argument, nullptr, 'c'},
+                                {"purge-token", required_argument, nullptr, 't'},
+                                {"huge-pages", no_argument, nullptr, huge_pages_option},
+                                {}};
   parsed_command command;
   int opt{};
   int longindex{};
-  while ((opt = ::getopt_long(argc, argv, "p", longopts, &longindex)) != -1) {
+  while ((opt = ::getopt_long(argc, argv, "pd:c:t:", longopts, &longindex)) != -1) {
     switch (opt) {
       case 'p':
         command.path = ::optarg != nullptr ? ::optarg : "";
         break;
+      case 'd':
+        command.dictionary = ::optarg;
+        break;
+      case 'c':
+        command.cache_dir = ::optarg;
+        break;
+      case 't':
+        command.purge_token = ::optarg;
+        break;
+      case huge_pages_option:
+        command.huge_pages = true;
+        break;
       default:
         break;
     }
@@ -457,20 +5122,33 @@ int main(int argc, char** argv) {
   auto const command = parse_command(argc, argv);
   std::filesystem::path index_html{"./index.html"};
   std::ifstream ifs{(command.path / index_html).lexically_normal()};
-  std::string html_str{std::istreambuf_iterator<char>{ifs}, std::istreambuf_iterator<char>{}};
+  nek::text_template const index{
+      std::string{std::istreambuf_iterator<char>{ifs}, std::istreambuf_iterator<char>{}}};
   nek::server serve;
-  serve.get("/", [&html_str](nek::request const& req, nek::response& res) {
+  serve.workers(std::thread::hardware_concurrency()).huge_pages(command.huge_pages);
+  serve.get("/", [&index](nek::request const& req, nek::response& res) {
     std::cout << req.method() << " " << req.path() << "\n";
-    char const* placeholder = "{}";
-    static int count = 0;
-    auto copy = html_str;
-    auto const it = std::search(copy.begin(), copy.end(), placeholder, placeholder + 2);
-    if (it != html_str.end()) {
-      copy.replace(it, it + 2, std::to_string(count));
-      ++count;
-    }
-    res.send(copy);
+    static std::atomic<int> count{0};
+    res.surrogate_key("index").send(index.render(count++));
   });
+  nek::microcache_options page_cache;
+  page_cache.stale_while_revalidate = std::chrono::seconds{10};
+  page_cache.stale_if_error = std::chrono::seconds{60};
+  serve.microcache("/", page_cache);
+  if (!command.cache_dir.empty()) {
+    serve.spill_to_disk({command.cache_dir});
+  }
+  if (!command.purge_token.empty()) {
+    serve.serve_purge("/_purge", command.purge_token);
+  }
+  serve.compress();
+  if (!command.dictionary.empty()) {
+    serve.compression_dictionary(command.dictionary, "/_dictionary", "/*");
+  }
+  serve.serve_static("/", command.path, nek::static_options{true})
+      .cache_assets()
+      .cache_files()
+      .serve_stats("/_stats");
   serve.listen(3000);
   std::cout << "start server...\n";
 }
@@ -0,0 +1,32 @@
+#!/bin/bash
+# builds the server once per malloc implementation and runs nhs-bench-load against each build,
+# printing requests per second and resident memory side by side. allocators that are not
+# installed are skipped. arguments are passed to nhs-bench-load, e.g. --connections=1000.
+#
+# usage: tools/bench_allocators.sh [nhs-bench-load options]...
+cd "$(dirname "$0")/.."
+
+results=()
+for allocator in system mimalloc jemalloc tcmalloc; do
+  dir=build-$allocator
+  if ! cmake -S . -B $dir -DNHS_ALLOCATOR=$allocator > $dir.log 2>&1; then
+    echo "$allocator: not available, see $dir.log"
+    continue
+  fi
+  if ! cmake --build $dir -j"$(nproc)" >> $dir.log 2>&1; then
+    echo "$allocator: build failed, see $dir.log"
+    continue
+  fi
+  echo "$allocator:"
+  output=$($dir/nhs-bench-load "$@" -- $dir/simple-http-server --path=public) || exit 1
+  echo "$output"
+  value() {
+    echo "$output" | awk -v key=$1 '$1 == key { print $2 }'
+  }
+  results+=("$(printf "%-10s %12s %8s %12s %14s" $allocator "$(value requests_per_second)" \
+    "$(value errors)" "$(value rss_kib)" "$(value peak_rss_kib)")")
+done
+
+echo
+printf "%-10s %12s %8s %12s %14s\n" allocator requests/s errors rss_kib peak_rss_kib
+printf "%s\n" "${results[@]}"
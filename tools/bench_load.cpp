@@ -0,0 +1,313 @@
+// drives a running or freshly started server with keep-alive GET requests and reports the
+// throughput together with the resident memory of the server, so builds with different
+// allocators (see NHS_ALLOCATOR in CMakeLists.txt) can be compared on the same workload. every
+// connection keeps one request in flight and cycles through the given paths.
+//
+// when a server command follows the options, it is started, given a moment to listen and stopped
+// after the run. otherwise --pid names the server whose memory is reported.
+//
+// usage: nhs-bench-load [--port=N] [--connections=N] [--threads=N] [--duration=SECONDS]
+//                       [--path=PATH]... [--pid=PID] [-- <server command>...]
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+  struct options {
+    int port = 3000;
+    std::size_t connections = 64;
+    std::size_t threads = 2;
+    double duration = 10;
+    std::vector<std::string> paths;
+    ::pid_t pid = 0;
+  };
+
+  struct counters {
+    std::atomic<std::uint64_t> responses{0};
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> errors{0};
+  };
+
+  int connect_to(int port) {
+    auto const fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error{"socket failed"};
+    }
+    ::sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<::sockaddr*>(&addr), sizeof(addr)) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+  }
+
+  // a keep-alive connection with one request in flight
+  struct client {
+    int fd = -1;
+    std::size_t next = 0;
+    std::string input;
+    std::size_t expected = 0;  // length of the response being read, once its head is complete
+
+    bool send(std::vector<std::string> const& requests) {
+      auto const& request = requests[next++ % requests.size()];
+      return ::send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+             static_cast<::ssize_t>(request.size());
+    }
+
+    // returns the number of complete responses read, or -1 when the connection broke
+    int receive(counters& count) {
+      char buffer[16384];
+      auto const n = ::recv(fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        return n < 0 && errno == EAGAIN ? 0 : -1;
+      }
+      input.append(buffer, static_cast<std::size_t>(n));
+      int complete = 0;
+      while (true) {
+        if (expected == 0) {
+          auto const end = input.find("\r\n\r\n");
+          if (end == std::string::npos) {
+            break;
+          }
+          std::string_view const head{input.data(), end};
+          auto const status = head.substr(0, 12);
+          if (status != "HTTP/1.1 200" && status != "HTTP/1.1 304") {
+            count.errors.fetch_add(1, std::memory_order_relaxed);
+          }
+          auto const field = head.find("\r\nContent-Length: ");
+          if (field == std::string_view::npos) {
+            return -1;
+          }
+          expected = end + 4 + std::strtoull(head.data() + field + 18, nullptr, 10);
+        }
+        if (input.size() < expected) {
+          break;
+        }
+        count.bytes.fetch_add(expected, std::memory_order_relaxed);
+        input.erase(0, expected);
+        expected = 0;
+        ++complete;
+      }
+      return complete;
+    }
+  };
+
+  void drive(options const& opts, std::size_t connections, std::atomic<bool> const& stop,
+             counters& count) {
+    std::vector<std::string> requests;
+    for (auto const& path : opts.paths) {
+      requests.push_back("GET " + path +
+                         " HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n\r\n");
+    }
+    auto const epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    std::vector<client> clients(connections);
+    for (std::size_t i = 0; i < connections; ++i) {
+      clients[i].fd = connect_to(opts.port);
+      clients[i].next = i;
+      if (clients[i].fd < 0 || !clients[i].send(requests)) {
+        throw std::runtime_error{"cannot connect to port " + std::to_string(opts.port)};
+      }
+      ::epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.ptr = &clients[i];
+      ::epoll_ctl(epoll, EPOLL_CTL_ADD, clients[i].fd, &event);
+    }
+    ::epoll_event events[64];
+    while (!stop.load(std::memory_order_relaxed)) {
+      auto const n = ::epoll_wait(epoll, events, 64, 100);
+      for (int i = 0; i < n; ++i) {
+        auto& c = *static_cast<client*>(events[i].data.ptr);
+        auto const complete = c.receive(count);
+        if (complete < 0) {
+          // the server closed the connection, for example while shedding load
+          count.errors.fetch_add(1, std::memory_order_relaxed);
+          ::epoll_ctl(epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+          ::close(c.fd);
+          c = client{connect_to(opts.port), c.next};
+          if (c.fd < 0 || !c.send(requests)) {
+            continue;
+          }
+          events[i].events = EPOLLIN;
+          ::epoll_ctl(epoll, EPOLL_CTL_ADD, c.fd, &events[i]);
+        } else if (complete > 0) {
+          count.responses.fetch_add(static_cast<std::uint64_t>(complete),
+                                    std::memory_order_relaxed);
+          c.send(requests);
+        }
+      }
+    }
+    for (auto& c : clients) {
+      if (c.fd >= 0) {
+        ::close(c.fd);
+      }
+    }
+    ::close(epoll);
+  }
+
+  // VmRSS or VmHWM of a process in KiB, 0 when it cannot be read
+  std::uint64_t memory_of(::pid_t pid, std::string_view field) {
+    std::ifstream status{"/proc/" + std::to_string(pid) + "/status"};
+    std::string line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, field.size(), field) == 0 && line.size() > field.size() &&
+          line[field.size()] == ':') {
+        return std::strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+      }
+    }
+    return 0;
+  }
+
+  ::pid_t start(char** command, int port) {
+    auto const pid = ::fork();
+    if (pid < 0) {
+      throw std::runtime_error{"fork failed"};
+    }
+    if (pid == 0) {
+      // the server logs every handled request, which would only slow it down here
+      if (auto const null = ::open("/dev/null", O_WRONLY); null >= 0) {
+        ::dup2(null, STDOUT_FILENO);
+      }
+      ::execvp(command[0], command);
+      std::perror(command[0]);
+      std::_Exit(127);
+    }
+    for (int i = 0; i < 100; ++i) {
+      auto const fd = connect_to(port);
+      if (fd >= 0) {
+        ::close(fd);
+        return pid;
+      }
+      if (::waitpid(pid, nullptr, WNOHANG) == pid) {
+        throw std::runtime_error{std::string{command[0]} + " exited before listening"};
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    }
+    ::kill(pid, SIGTERM);
+    throw std::runtime_error{std::string{command[0]} + " is not listening on the port"};
+  }
+}
+
+int main(int argc, char** argv) {
+  static ::option longopts[] = {{"port", required_argument, nullptr, 'P'},
+                                {"connections", required_argument, nullptr, 'c'},
+                                {"threads", required_argument, nullptr, 't'},
+                                {"duration", required_argument, nullptr, 'd'},
+                                {"path", required_argument, nullptr, 'p'},
+                                {"pid", required_argument, nullptr, 'i'},
+                                {}};
+  options opts;
+  int opt{};
+  // '+' stops at the server command instead of permuting its options
+  while ((opt = ::getopt_long(argc, argv, "+P:c:t:d:p:i:", longopts, nullptr)) != -1) {
+    switch (opt) {
+      case 'P':
+        opts.port = std::atoi(::optarg);
+        break;
+      case 'c':
+        opts.connections = std::strtoull(::optarg, nullptr, 10);
+        break;
+      case 't':
+        opts.threads = std::strtoull(::optarg, nullptr, 10);
+        break;
+      case 'd':
+        opts.duration = std::strtod(::optarg, nullptr);
+        break;
+      case 'p':
+        opts.paths.emplace_back(::optarg);
+        break;
+      case 'i':
+        opts.pid = static_cast<::pid_t>(std::atoi(::optarg));
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (opts.paths.empty()) {
+    opts.paths = {"/index.html", "/"};
+  }
+  if (opts.threads == 0 || opts.connections < opts.threads || opts.duration <= 0) {
+    std::fprintf(stderr, "there have to be at least as many connections as threads\n");
+    return 2;
+  }
+  ::pid_t started = 0;
+  try {
+    if (::optind < argc) {
+      started = start(argv + ::optind, opts.port);
+      opts.pid = started;
+    }
+    counters count;
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> failures(opts.threads);
+    auto const begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < opts.threads; ++i) {
+      auto const share = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+      threads.emplace_back([&, i, share] {
+        try {
+          drive(opts, share, stop, count);
+        } catch (...) {
+          failures[i] = std::current_exception();
+          stop = true;
+        }
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>{opts.duration});
+    stop = true;
+    for (auto& t : threads) {
+      t.join();
+    }
+    auto const seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    for (auto const& failure : failures) {
+      if (failure) {
+        std::rethrow_exception(failure);
+      }
+    }
+    std::printf("%zu connections, %zu threads, %.1f s\n", opts.connections, opts.threads, seconds);
+    std::printf("requests_per_second %.0f\n", count.responses / seconds);
+    std::printf("megabytes_per_second %.1f\n", count.bytes / seconds / (1 << 20));
+    std::printf("errors %llu\n", static_cast<unsigned long long>(count.errors.load()));
+    if (opts.pid > 0) {
+      std::printf("rss_kib %llu\n", static_cast<unsigned long long>(memory_of(opts.pid, "VmRSS")));
+      std::printf("peak_rss_kib %llu\n",
+                  static_cast<unsigned long long>(memory_of(opts.pid, "VmHWM")));
+    }
+  } catch (std::exception const& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    if (started > 0) {
+      ::kill(started, SIGTERM);
+      ::waitpid(started, nullptr, 0);
+    }
+    return 1;
+  }
+  if (started > 0) {
+    ::kill(started, SIGTERM);
+    ::waitpid(started, nullptr, 0);
+  }
+}
@@ -0,0 +1,236 @@
+// compares dTLB misses of connection buffers allocated one by one from the heap with the same
+// buffers carved out of 2 MiB pages, as the event loops do with server::huge_pages(). each
+// simulated read writes a request into the buffer of a random connection and parses its first
+// bytes back, so the accesses are scattered over all buffers like those of many idle clients.
+//
+// the misses are counted with perf_event_open(2). where it is not permitted, for example with
+// kernel.perf_event_paranoid above 2 or in a container, only the time per access is reported.
+//
+// usage: nhs-bench-tlb [--connections=N] [--buffer-size=N] [--accesses=N]
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  constexpr std::size_t region_size = 2 << 20;
+
+  // counts dTLB load and store misses of this thread, or nothing when perf is not available.
+  class tlb_counter {
+    int loads_ = -1;
+    int stores_ = -1;
+
+    static int open(std::uint64_t op) {
+      ::perf_event_attr attr{};
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static std::uint64_t read(int fd) {
+      std::uint64_t value = 0;
+      if (fd < 0 || ::read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+      }
+      return value;
+    }
+
+  public:
+    tlb_counter()
+        : loads_{open(PERF_COUNT_HW_CACHE_OP_READ)}, stores_{open(PERF_COUNT_HW_CACHE_OP_WRITE)} {
+    }
+
+    tlb_counter(tlb_counter const&) = delete;
+    tlb_counter& operator=(tlb_counter const&) = delete;
+
+    ~tlb_counter() {
+      for (auto fd : {loads_, stores_}) {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+      }
+    }
+
+    bool available() const noexcept {
+      return loads_ >= 0;
+    }
+
+    void start() {
+      for (auto fd : {loads_, stores_}) {
+        if (fd >= 0) {
+          ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    std::uint64_t stop() {
+      for (auto fd : {loads_, stores_}) {
+        if (fd >= 0) {
+          ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+      }
+      return read(loads_) + read(stores_);
+    }
+  };
+
+  // maps 2 MiB like buffer_pool does and returns how it was backed.
+  std::byte* map_region(std::string& backing) {
+    auto const flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    auto* region = ::mmap(nullptr, region_size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+      backing = "hugetlb";
+      return static_cast<std::byte*>(region);
+    }
+    auto* const mapped = ::mmap(nullptr, region_size * 2, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error{"mmap failed"};
+    }
+    auto const address = reinterpret_cast<std::uintptr_t>(mapped);
+    auto const aligned = (address + region_size - 1) & ~(region_size - 1);
+    if (aligned > address) {
+      ::munmap(mapped, aligned - address);
+    }
+    ::munmap(reinterpret_cast<void*>(aligned + region_size), address + region_size - aligned);
+    ::madvise(reinterpret_cast<void*>(aligned), region_size, MADV_HUGEPAGE);
+    backing = "transparent";
+    return reinterpret_cast<std::byte*>(aligned);
+  }
+
+  // keeps the parsing from being optimized away
+  volatile std::uint64_t sink;
+
+  struct result {
+    double nanoseconds;
+    std::uint64_t misses;
+  };
+
+  result run(std::vector<std::byte*> const& buffers,
+             std::vector<std::uint32_t> const& order,
+             tlb_counter& counter) {
+    static constexpr char request[] =
+        "GET /index.html HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n"
+        "Accept-Encoding: gzip, br\r\nUser-Agent: nhs-bench-tlb\r\n\r\n";
+    std::uint64_t parsed = 0;
+    counter.start();
+    auto const begin = std::chrono::steady_clock::now();
+    for (auto const i : order) {
+      auto* const buffer = buffers[i];
+      std::memcpy(buffer, request, sizeof(request) - 1);
+      for (std::size_t j = 0; j < sizeof(request) - 1 && buffer[j] != std::byte{'\r'}; ++j) {
+        parsed += static_cast<std::uint8_t>(buffer[j]);
+      }
+    }
+    auto const end = std::chrono::steady_clock::now();
+    auto const misses = counter.stop();
+    sink = parsed;
+    return {std::chrono::duration<double, std::nano>(end - begin).count() / order.size(), misses};
+  }
+
+  void report(char const* name, result r, std::size_t accesses, bool counted) {
+    if (counted) {
+      std::printf("%-24s %10.2f ns/access %10.1f dTLB misses per 1000 accesses\n", name,
+                  r.nanoseconds, r.misses * 1000.0 / accesses);
+    } else {
+      std::printf("%-24s %10.2f ns/access\n", name, r.nanoseconds);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  static ::option longopts[] = {{"connections", required_argument, nullptr, 'c'},
+                                {"buffer-size", required_argument, nullptr, 'b'},
+                                {"accesses", required_argument, nullptr, 'a'},
+                                {}};
+  std::size_t connections = 20000;
+  std::size_t buffer_size = 4096;
+  std::size_t accesses = 10000000;
+  int opt{};
+  while ((opt = ::getopt_long(argc, argv, "c:b:a:", longopts, nullptr)) != -1) {
+    switch (opt) {
+      case 'c':
+        connections = std::strtoull(::optarg, nullptr, 10);
+        break;
+      case 'b':
+        buffer_size = std::strtoull(::optarg, nullptr, 10);
+        break;
+      case 'a':
+        accesses = std::strtoull(::optarg, nullptr, 10);
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (connections == 0 || buffer_size < 256 || buffer_size > region_size ||
+      region_size % buffer_size != 0) {
+    std::fprintf(stderr, "the buffer size has to divide 2 MiB and be at least 256 bytes\n");
+    return 2;
+  }
+  try {
+    std::mt19937 random{42};
+    std::uniform_int_distribution<std::uint32_t> pick(0, connections - 1);
+    std::vector<std::uint32_t> order(accesses);
+    for (auto& i : order) {
+      i = pick(random);
+    }
+    tlb_counter counter;
+    if (!counter.available()) {
+      std::printf("perf_event_open is not permitted; dTLB misses are not counted\n");
+    }
+
+    // the heap buffers are interleaved with other small allocations, as they are in the server
+    std::vector<std::unique_ptr<std::byte[]>> heap;
+    std::vector<std::unique_ptr<char[]>> noise;
+    std::vector<std::byte*> heap_buffers;
+    for (std::size_t i = 0; i < connections; ++i) {
+      heap.emplace_back(new std::byte[buffer_size]);
+      noise.emplace_back(new char[64 + i % 512]);
+      std::memset(heap.back().get(), 0, buffer_size);
+      heap_buffers.push_back(heap.back().get());
+    }
+
+    std::string backing;
+    std::vector<std::byte*> regions;
+    std::vector<std::byte*> huge_buffers;
+    for (std::size_t i = 0; i < connections; ++i) {
+      auto const offset = i * buffer_size % region_size;
+      if (offset == 0) {
+        regions.push_back(map_region(backing));
+        std::memset(regions.back(), 0, region_size);
+      }
+      huge_buffers.push_back(regions.back() + offset);
+    }
+
+    std::printf("%zu connections, %zu byte buffers, %zu accesses, 2 MiB pages: %s\n",
+                connections, buffer_size, accesses, backing.c_str());
+    // a warm-up pass of each, then the measured ones
+    run(heap_buffers, order, counter);
+    run(huge_buffers, order, counter);
+    report("heap buffers", run(heap_buffers, order, counter), accesses, counter.available());
+    report("2 MiB page buffers", run(huge_buffers, order, counter), accesses,
+           counter.available());
+    for (auto* region : regions) {
+      ::munmap(region, region_size);
+    }
+  } catch (std::exception const& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,156 @@
+// generates precompressed sidecars (file.gz, file.br and file.zst) for the files under a
+// directory tree at the maximum compression level. the server sends them for the clients which
+// accept the coding, so compression costs nothing at request time.
+//
+// usage: nhs-precompress [--min-size=N] <directory>...
+#include <getopt.h>
+#include <zlib.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef NHS_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef NHS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+  std::string gzip(std::string const& input) {
+    z_stream stream{};
+    // 15 + 16 writes a gzip header and trailer instead of a zlib one
+    if (::deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+      throw std::runtime_error{"deflateInit2"};
+    }
+    std::string output(::deflateBound(&stream, input.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+    auto const result = ::deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    ::deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+      throw std::runtime_error{"deflate"};
+    }
+    return output;
+  }
+
+#ifdef NHS_HAVE_BROTLI
+  std::string brotli(std::string const& input) {
+    std::string output(::BrotliEncoderMaxCompressedSize(input.size()), '\0');
+    auto size = output.size();
+    if (!::BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_GENERIC,
+                                 input.size(),
+                                 reinterpret_cast<std::uint8_t const*>(input.data()), &size,
+                                 reinterpret_cast<std::uint8_t*>(output.data()))) {
+      throw std::runtime_error{"BrotliEncoderCompress"};
+    }
+    output.resize(size);
+    return output;
+  }
+#endif
+
+#ifdef NHS_HAVE_ZSTD
+  std::string zstd(std::string const& input) {
+    std::string output(::ZSTD_compressBound(input.size()), '\0');
+    auto const size = ::ZSTD_compress(output.data(), output.size(), input.data(), input.size(),
+                                      ::ZSTD_maxCLevel());
+    if (::ZSTD_isError(size)) {
+      throw std::runtime_error{::ZSTD_getErrorName(size)};
+    }
+    output.resize(size);
+    return output;
+  }
+#endif
+
+  struct coding {
+    std::string_view extension;
+    std::string (*compress)(std::string const&);
+  };
+
+  coding const codings[] = {
+      {".gz", gzip},
+#ifdef NHS_HAVE_BROTLI
+      {".br", brotli},
+#endif
+#ifdef NHS_HAVE_ZSTD
+      {".zst", zstd},
+#endif
+  };
+
+  bool is_sidecar(std::filesystem::path const& path) {
+    auto const extension = path.extension();
+    return extension == ".gz" || extension == ".br" || extension == ".zst" ||
+           extension == ".tmp";
+  }
+
+  // writes the sidecars of a file. a sidecar which would not be smaller than the file is removed,
+  // so the server falls back to the original.
+  void precompress(std::filesystem::path const& path) {
+    std::ifstream ifs{path, std::ios::binary};
+    std::string const input{std::istreambuf_iterator<char>{ifs}, std::istreambuf_iterator<char>{}};
+    for (auto const& c : codings) {
+      auto sidecar = path;
+      sidecar += std::string{c.extension};
+      auto const output = c.compress(input);
+      if (output.size() >= input.size()) {
+        std::filesystem::remove(sidecar);
+        continue;
+      }
+      // write to a temporary file and rename it, so the server never sees a partial sidecar
+      auto temporary = sidecar;
+      temporary += ".tmp";
+      {
+        std::ofstream ofs{temporary, std::ios::binary | std::ios::trunc};
+        ofs.write(output.data(), static_cast<std::streamsize>(output.size()));
+        if (!ofs) {
+          throw std::runtime_error{"failed to write " + temporary.string()};
+        }
+      }
+      std::filesystem::rename(temporary, sidecar);
+      std::cout << sidecar.string() << " " << input.size() << " -> " << output.size() << "\n";
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  static ::option longopts[] = {{"min-size", required_argument, nullptr, 'm'}, {}};
+  std::uintmax_t min_size = 256;
+  int opt{};
+  int longindex{};
+  while ((opt = ::getopt_long(argc, argv, "m:", longopts, &longindex)) != -1) {
+    switch (opt) {
+      case 'm':
+        min_size = std::stoull(::optarg);
+        break;
+      default:
+        std::cerr << "usage: " << argv[0] << " [--min-size=N] <directory>...\n";
+        return 2;
+    }
+  }
+  if (::optind >= argc) {
+    std::cerr << "usage: " << argv[0] << " [--min-size=N] <directory>...\n";
+    return 2;
+  }
+  try {
+    for (auto i = ::optind; i < argc; ++i) {
+      for (auto const& entry : std::filesystem::recursive_directory_iterator{argv[i]}) {
+        if (entry.is_regular_file() && !is_sidecar(entry.path()) &&
+            entry.file_size() >= min_size) {
+          precompress(entry.path());
+        }
+      }
+    }
+  } catch (std::exception const& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,78 @@
+// trains a raw content dictionary for compression-dictionary-transport from a corpus of captured
+// response bodies. every regular file under the corpus directories is one sample. the entropy
+// tables of the trained zstd dictionary are stripped, since clients use the dictionary as raw
+// content for both dcz and dcb.
+//
+// usage: nhs-train-dictionary [--size=N] <output> <corpus directory>...
+#include <getopt.h>
+#include <zdict.h>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  std::string read(std::filesystem::path const& path) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in) {
+      throw std::runtime_error{"cannot read " + path.string()};
+    }
+    return {std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+  }
+}
+
+int main(int argc, char** argv) {
+  static ::option longopts[] = {{"size", required_argument, nullptr, 's'}, {}};
+  std::size_t capacity = 64 << 10;
+  int opt{};
+  while ((opt = ::getopt_long(argc, argv, "s:", longopts, nullptr)) != -1) {
+    if (opt == 's') {
+      capacity = std::strtoull(::optarg, nullptr, 10);
+    } else {
+      return 2;
+    }
+  }
+  if (argc - ::optind < 2) {
+    std::cerr << "usage: nhs-train-dictionary [--size=N] <output> <corpus directory>...\n";
+    return 2;
+  }
+  try {
+    std::string samples;
+    std::vector<std::size_t> sizes;
+    for (auto i = ::optind + 1; i < argc; ++i) {
+      for (auto const& entry : std::filesystem::recursive_directory_iterator{argv[i]}) {
+        if (!entry.is_regular_file()) {
+          continue;
+        }
+        auto const content = read(entry.path());
+        if (!content.empty()) {
+          samples.append(content);
+          sizes.push_back(content.size());
+        }
+      }
+    }
+    std::string dictionary(capacity, '\0');
+    auto const size = ::ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(),
+                                              sizes.data(), static_cast<unsigned>(sizes.size()));
+    if (::ZDICT_isError(size)) {
+      throw std::runtime_error{::ZDICT_getErrorName(size)};
+    }
+    auto const header = ::ZDICT_getDictHeaderSize(dictionary.data(), size);
+    if (::ZDICT_isError(header)) {
+      throw std::runtime_error{::ZDICT_getErrorName(header)};
+    }
+    std::ofstream out{argv[::optind], std::ios::binary | std::ios::trunc};
+    out.write(dictionary.data() + header, static_cast<std::streamsize>(size - header));
+    if (!out) {
+      throw std::runtime_error{std::string{"cannot write "} + argv[::optind]};
+    }
+    std::cout << sizes.size() << " samples, " << size - header << " bytes\n";
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}